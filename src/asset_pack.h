@@ -0,0 +1,222 @@
+
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+// Pack of images already decoded to the pixel format they are uploaded in,
+// written offline by tools/asset_packer.c.
+//
+// Header: "WOPA", u16 version, u16 entries count, then per entry: u16 name
+// size, name with its terminating zero, u32 width, height, pixel format
+// (raylib PixelFormat), mipmaps, data offset and data size. Pixel data
+// follows, every entry aligned to ASSET_PACK_ALIGNMENT bytes.
+// The reader only checks that the data of an entry is in the pack. The pixels
+// it must hold depend on the format, so users check them before uploading.
+//
+// The pack is mapped in memory where mmap is available and read in one go
+// otherwise. Entries point into it, so their pixels can be handed to the GPU
+// without any copy, until CloseAssetPack.
+
+#include "binary_io.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define ASSET_PACK_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef ASSETPACKDEF
+#define ASSETPACKDEF // Functions defined as 'extern' by default (implicit
+                     // specifiers)
+#endif
+
+#define ASSET_PACK_MAGIC "WOPA"
+#define ASSET_PACK_VERSION 1
+#define ASSET_PACK_ALIGNMENT 16
+
+typedef struct AssetPackEntry {
+  const char *name; // Path of the source file, "assets/map/grass.png"
+  int width;
+  int height;
+  int format;
+  int mipmaps;
+  const unsigned char *data;
+  int dataSize;
+} AssetPackEntry;
+
+typedef struct AssetPack {
+  const unsigned char *data;
+  int size;
+  AssetPackEntry *entries;
+  int entriesCount;
+  bool isMapped; // Else data was allocated, unless it is not owned
+  bool isOwned;
+} AssetPack;
+
+// READER
+
+// Reads the index of a pack held in memory, which must outlive it.
+// Returns false when it is not a valid pack.
+ASSETPACKDEF bool OpenAssetPackFromMemory(AssetPack *pack,
+                                          const unsigned char *data,
+                                          int size) {
+  *pack = (AssetPack){.data = data, .size = size};
+  ByteReader reader = CreateByteReader(data, size);
+  char magic[4];
+  ReadBytes(&reader, magic, 4);
+  if (!reader.isValid || memcmp(magic, ASSET_PACK_MAGIC, 4) != 0 ||
+      ReadU16(&reader) != ASSET_PACK_VERSION)
+    return false;
+  pack->entriesCount = ReadU16(&reader);
+  pack->entries =
+      (AssetPackEntry *)calloc(pack->entriesCount, sizeof(AssetPackEntry));
+  bool isValid = reader.isValid;
+  for (int i = 0; i < pack->entriesCount && isValid; i++) {
+    AssetPackEntry *entry = &pack->entries[i];
+    int nameSize = ReadU16(&reader);
+    if (nameSize == 0 || reader.position + nameSize > size ||
+        data[reader.position + nameSize - 1] != '\0') {
+      isValid = false;
+      break;
+    }
+    entry->name = (const char *)data + reader.position;
+    reader.position += nameSize;
+    entry->width = ReadU32(&reader);
+    entry->height = ReadU32(&reader);
+    entry->format = ReadU32(&reader);
+    entry->mipmaps = ReadU32(&reader);
+    uint32_t offset = ReadU32(&reader);
+    uint32_t dataSize = ReadU32(&reader);
+    entry->data = data + offset;
+    entry->dataSize = dataSize;
+    isValid = reader.isValid && offset <= (uint32_t)size &&
+              dataSize <= (uint32_t)size - offset;
+  }
+  if (!isValid) {
+    free(pack->entries);
+    *pack = (AssetPack){0};
+  }
+  return isValid;
+}
+
+ASSETPACKDEF void CloseAssetPack(AssetPack *pack) {
+#if defined(ASSET_PACK_MMAP)
+  if (pack->isMapped)
+    munmap((void *)pack->data, pack->size);
+#endif
+  if (pack->isOwned)
+    free((void *)pack->data);
+  free(pack->entries);
+  *pack = (AssetPack){0};
+}
+
+// Returns false when the file is missing or not a valid pack
+ASSETPACKDEF bool OpenAssetPack(AssetPack *pack, const char *fileName) {
+  *pack = (AssetPack){0};
+#if defined(ASSET_PACK_MMAP)
+  int file = open(fileName, O_RDONLY);
+  if (file < 0)
+    return false;
+  struct stat status;
+  void *data = MAP_FAILED;
+  if (fstat(file, &status) == 0 && status.st_size > 0)
+    data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file); // The mapping keeps the file open
+  if (data == MAP_FAILED)
+    return false;
+  int size = status.st_size;
+  bool isMapped = true, isOwned = false;
+#else
+  FILE *file = fopen(fileName, "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  unsigned char *data = (unsigned char *)malloc(fileSize > 0 ? fileSize : 1);
+  int size = fread(data, 1, fileSize > 0 ? fileSize : 0, file);
+  fclose(file);
+  bool isMapped = false, isOwned = true;
+#endif
+  bool isValid =
+      OpenAssetPackFromMemory(pack, (const unsigned char *)data, size);
+  pack->data = (const unsigned char *)data;
+  pack->size = size;
+  pack->isMapped = isMapped;
+  pack->isOwned = isOwned;
+  if (!isValid)
+    CloseAssetPack(pack);
+  return isValid;
+}
+
+// First entry of that name, NULL when there is none
+ASSETPACKDEF const AssetPackEntry *FindAssetPackEntry(AssetPack *pack,
+                                                      const char *name) {
+  for (int i = 0; i < pack->entriesCount; i++) {
+    if (strcmp(pack->entries[i].name, name) == 0)
+      return &pack->entries[i];
+  }
+  return NULL;
+}
+
+// A pack may hold several formats of the same image
+ASSETPACKDEF const AssetPackEntry *
+FindAssetPackEntryFormat(AssetPack *pack, const char *name, int format) {
+  for (int i = 0; i < pack->entriesCount; i++) {
+    if (pack->entries[i].format == format &&
+        strcmp(pack->entries[i].name, name) == 0)
+      return &pack->entries[i];
+  }
+  return NULL;
+}
+
+// WRITER
+
+// Entries data offsets are computed, returns false when the file could not
+// be written
+ASSETPACKDEF bool WriteAssetPack(const char *fileName,
+                                 const AssetPackEntry *entries,
+                                 int entriesCount) {
+  int indexSize = 4 + 2 + 2;
+  for (int i = 0; i < entriesCount; i++) {
+    indexSize += 2 + strlen(entries[i].name) + 1 + 6 * 4;
+  }
+  ByteWriter writer = {0};
+  WriteBytes(&writer, ASSET_PACK_MAGIC, 4);
+  WriteU16(&writer, ASSET_PACK_VERSION);
+  WriteU16(&writer, entriesCount);
+  uint32_t offset = indexSize;
+  for (int i = 0; i < entriesCount; i++) {
+    const AssetPackEntry *entry = &entries[i];
+    int nameSize = strlen(entry->name) + 1;
+    offset = (offset + ASSET_PACK_ALIGNMENT - 1) & ~(ASSET_PACK_ALIGNMENT - 1);
+    WriteU16(&writer, nameSize);
+    WriteBytes(&writer, entry->name, nameSize);
+    WriteU32(&writer, entry->width);
+    WriteU32(&writer, entry->height);
+    WriteU32(&writer, entry->format);
+    WriteU32(&writer, entry->mipmaps);
+    WriteU32(&writer, offset);
+    WriteU32(&writer, entry->dataSize);
+    offset += entry->dataSize;
+  }
+  for (int i = 0; i < entriesCount; i++) {
+    static const unsigned char padding[ASSET_PACK_ALIGNMENT] = {0};
+    WriteBytes(&writer, padding, -writer.size & (ASSET_PACK_ALIGNMENT - 1));
+    WriteBytes(&writer, entries[i].data, entries[i].dataSize);
+  }
+  FILE *file = fopen(fileName, "wb");
+  bool isWritten =
+      file && fwrite(writer.data, 1, writer.size, file) == (size_t)writer.size;
+  if (file)
+    isWritten = fclose(file) == 0 && isWritten;
+  FreeByteWriter(&writer);
+  return isWritten;
+}
+
+#endif // ASSET_PACK_H
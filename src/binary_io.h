@@ -0,0 +1,169 @@
+
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+// Little endian readers and writers for the game binary formats. Values are
+// written byte by byte so files are the same on every platform.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef BINARYIODEF
+#define BINARYIODEF // Functions defined as 'extern' by default (implicit
+                    // specifiers)
+#endif
+
+// Growable output buffer
+typedef struct ByteWriter {
+  unsigned char *data;
+  int size;
+  int capacity;
+} ByteWriter;
+
+// Cursor over a read only buffer. isValid turns false on the first read past
+// the end, reads then return zeros.
+typedef struct ByteReader {
+  const unsigned char *data;
+  int size;
+  int position;
+  bool isValid;
+} ByteReader;
+
+// WRITER
+
+BINARYIODEF void WriteBytes(ByteWriter *writer, const void *bytes, int count) {
+  if (writer->size + count > writer->capacity) {
+    int capacity = writer->capacity ? writer->capacity : 256;
+    while (capacity < writer->size + count) {
+      capacity *= 2;
+    }
+    writer->data = (unsigned char *)realloc(writer->data, capacity);
+    writer->capacity = capacity;
+  }
+  memcpy(writer->data + writer->size, bytes, count);
+  writer->size += count;
+}
+
+BINARYIODEF void WriteU8(ByteWriter *writer, uint8_t value) {
+  WriteBytes(writer, &value, 1);
+}
+
+BINARYIODEF void WriteU16(ByteWriter *writer, uint16_t value) {
+  unsigned char bytes[2] = {value & 0xFF, value >> 8};
+  WriteBytes(writer, bytes, 2);
+}
+
+BINARYIODEF void WriteU32(ByteWriter *writer, uint32_t value) {
+  unsigned char bytes[4] = {value & 0xFF, (value >> 8) & 0xFF,
+                            (value >> 16) & 0xFF, value >> 24};
+  WriteBytes(writer, bytes, 4);
+}
+
+BINARYIODEF void WriteU64(ByteWriter *writer, uint64_t value) {
+  WriteU32(writer, (uint32_t)value);
+  WriteU32(writer, (uint32_t)(value >> 32));
+}
+
+BINARYIODEF void WriteF32(ByteWriter *writer, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  WriteU32(writer, bits);
+}
+
+// LEB128: 1 byte below 128, 2 bytes below 16384...
+BINARYIODEF void WriteVarint(ByteWriter *writer, uint32_t value) {
+  while (value >= 0x80) {
+    WriteU8(writer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  WriteU8(writer, value);
+}
+
+BINARYIODEF void FreeByteWriter(ByteWriter *writer) {
+  free(writer->data);
+  *writer = (ByteWriter){0};
+}
+
+// READER
+
+BINARYIODEF ByteReader CreateByteReader(const unsigned char *data, int size) {
+  return (ByteReader){.data = data, .size = size, .isValid = data != NULL};
+}
+
+BINARYIODEF bool ReadBytes(ByteReader *reader, void *bytes, int count) {
+  if (!reader->isValid || reader->position + count > reader->size) {
+    reader->isValid = false;
+    memset(bytes, 0, count);
+    return false;
+  }
+  memcpy(bytes, reader->data + reader->position, count);
+  reader->position += count;
+  return true;
+}
+
+BINARYIODEF uint8_t ReadU8(ByteReader *reader) {
+  uint8_t value;
+  ReadBytes(reader, &value, 1);
+  return value;
+}
+
+BINARYIODEF uint16_t ReadU16(ByteReader *reader) {
+  unsigned char bytes[2];
+  ReadBytes(reader, bytes, 2);
+  return bytes[0] | (bytes[1] << 8);
+}
+
+BINARYIODEF uint32_t ReadU32(ByteReader *reader) {
+  unsigned char bytes[4];
+  ReadBytes(reader, bytes, 4);
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+         ((uint32_t)bytes[3] << 24);
+}
+
+BINARYIODEF uint64_t ReadU64(ByteReader *reader) {
+  uint64_t low = ReadU32(reader);
+  uint64_t high = ReadU32(reader);
+  return low | (high << 32);
+}
+
+BINARYIODEF float ReadF32(ByteReader *reader) {
+  uint32_t bits = ReadU32(reader);
+  float value;
+  memcpy(&value, &bits, 4);
+  return value;
+}
+
+BINARYIODEF uint32_t ReadVarint(ByteReader *reader) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = ReadU8(reader);
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  reader->isValid = false;
+  return 0;
+}
+
+BINARYIODEF bool IsByteReaderAtEnd(ByteReader *reader) {
+  return reader->position >= reader->size;
+}
+
+// HASHING
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// 64 bits FNV-1a, chain calls by passing the previous hash
+BINARYIODEF uint64_t HashBytes(uint64_t hash, const void *bytes, int count) {
+  const unsigned char *data = (const unsigned char *)bytes;
+  for (int i = 0; i < count; i++) {
+    hash ^= data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+#endif // BINARY_IO_H
@@ -0,0 +1,287 @@
+
+#ifndef INSTANCED_SPRITES_H
+#define INSTANCED_SPRITES_H
+
+// Draws many sprites of the same texture in one instanced draw call.
+//
+// Instances are kept in a persistent vertex buffer: every frame the caller
+// adds them again in the same order, and only the range of instances which
+// changed since the previous frame is uploaded. A frame may draw its
+// instances in several runs, each one drawing those added since the previous
+// run, to keep them in order with what is drawn in between. Needs OpenGL
+// 3.3, check AreInstancedSpritesSupported() and fall back to DrawTextureRec
+// otherwise.
+
+#include "raylib.h"
+#include "rlgl.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef INSTANCEDSPRITESDEF
+#define INSTANCEDSPRITESDEF // Functions defined as 'extern' by default
+                            // (implicit specifiers)
+#endif
+
+// Per instance data, 16 bytes
+typedef struct SpriteInstance {
+  Vector2 position; // Top left corner in world coordinates
+  float frame;      // Animation frame, in frame widths from the left
+  Color tint;
+} SpriteInstance;
+
+typedef struct InstancedSprites {
+  Texture2D texture;
+  int framesCount;
+  unsigned int vaoId;
+  unsigned int quadVboId;
+  unsigned int instancesVboId;
+  SpriteInstance *instances;
+  int instancesCount; // Valid in both buffers once the dirty ones are sent
+  int instancesCapacity;
+  int gpuCapacity; // Instances the GPU buffer can hold
+  int nextInstance;
+  int nextRunStart; // First instance not drawn yet this frame
+  int dirtyStart; // Range of instances to upload before the next draw
+  int dirtyEnd;
+} InstancedSprites;
+
+// SHADER
+
+static const char *instancedSpritesVertexShader =
+    "#version 330\n"
+    "in vec2 vertexPosition;\n"
+    "in vec2 instancePosition;\n"
+    "in float instanceFrame;\n"
+    "in vec4 instanceTint;\n"
+    "uniform mat4 projection;\n"
+    "uniform mat4 modelview;\n"
+    "uniform vec2 frameSize;\n"
+    "uniform float framesCount;\n"
+    "out vec2 fragTexCoord;\n"
+    "out vec4 fragColor;\n"
+    "void main() {\n"
+    "  fragTexCoord = vec2((instanceFrame + vertexPosition.x) / framesCount,\n"
+    "                      vertexPosition.y);\n"
+    "  fragColor = instanceTint;\n"
+    "  vec2 position = instancePosition + vertexPosition * frameSize;\n"
+    "  gl_Position = projection * modelview * vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *instancedSpritesFragmentShader =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "  finalColor = texture(texture0, fragTexCoord) * fragColor;\n"
+    "}\n";
+
+// Shared by every InstancedSprites, loaded with the first one
+static struct {
+  unsigned int id;
+  int usersCount;
+  int vertexPositionLocation;
+  int instancePositionLocation;
+  int instanceFrameLocation;
+  int instanceTintLocation;
+  int projectionLocation;
+  int modelviewLocation;
+  int frameSizeLocation;
+  int framesCountLocation;
+  int textureLocation;
+} instancedSpritesShader = {0};
+
+static void LoadInstancedSpritesShader(void) {
+  if (instancedSpritesShader.usersCount++ > 0)
+    return;
+  unsigned int id = rlLoadShaderCode(instancedSpritesVertexShader,
+                                     instancedSpritesFragmentShader);
+  instancedSpritesShader.id = id;
+  instancedSpritesShader.vertexPositionLocation =
+      rlGetLocationAttrib(id, "vertexPosition");
+  instancedSpritesShader.instancePositionLocation =
+      rlGetLocationAttrib(id, "instancePosition");
+  instancedSpritesShader.instanceFrameLocation =
+      rlGetLocationAttrib(id, "instanceFrame");
+  instancedSpritesShader.instanceTintLocation =
+      rlGetLocationAttrib(id, "instanceTint");
+  instancedSpritesShader.projectionLocation =
+      rlGetLocationUniform(id, "projection");
+  instancedSpritesShader.modelviewLocation =
+      rlGetLocationUniform(id, "modelview");
+  instancedSpritesShader.frameSizeLocation =
+      rlGetLocationUniform(id, "frameSize");
+  instancedSpritesShader.framesCountLocation =
+      rlGetLocationUniform(id, "framesCount");
+  instancedSpritesShader.textureLocation =
+      rlGetLocationUniform(id, "texture0");
+}
+
+static void UnloadInstancedSpritesShader(void) {
+  if (--instancedSpritesShader.usersCount > 0)
+    return;
+  rlUnloadShaderProgram(instancedSpritesShader.id);
+  instancedSpritesShader.id = 0;
+}
+
+// Points the instance attributes of the currently enabled vertex array at
+// the instances from first. Instanced draws have no base instance before
+// OpenGL 4.2, runs start there instead.
+static void SetInstancesAttributes(InstancedSprites *sprites, int first) {
+  rlEnableVertexBuffer(sprites->instancesVboId);
+  int stride = sizeof(SpriteInstance);
+  int offset = first * stride;
+  rlSetVertexAttribute(instancedSpritesShader.instancePositionLocation, 2,
+                       RL_FLOAT, false, stride,
+                       offset + offsetof(SpriteInstance, position));
+  rlSetVertexAttribute(instancedSpritesShader.instanceFrameLocation, 1,
+                       RL_FLOAT, false, stride,
+                       offset + offsetof(SpriteInstance, frame));
+  rlSetVertexAttribute(instancedSpritesShader.instanceTintLocation, 4,
+                       RL_UNSIGNED_BYTE, true, stride,
+                       offset + offsetof(SpriteInstance, tint));
+}
+
+// Creates the instances buffer of the currently enabled vertex array
+static void LoadInstancesBuffer(InstancedSprites *sprites) {
+  sprites->instancesVboId =
+      rlLoadVertexBuffer(sprites->instances,
+                         sprites->instancesCapacity * sizeof(SpriteInstance),
+                         true);
+  sprites->gpuCapacity = sprites->instancesCapacity;
+  SetInstancesAttributes(sprites, 0);
+  int locations[3] = {instancedSpritesShader.instancePositionLocation,
+                      instancedSpritesShader.instanceFrameLocation,
+                      instancedSpritesShader.instanceTintLocation};
+  for (int i = 0; i < 3; i++) {
+    rlSetVertexAttributeDivisor(locations[i], 1);
+    rlEnableVertexAttribute(locations[i]);
+  }
+}
+
+// INSTANCED SPRITES
+
+INSTANCEDSPRITESDEF bool AreInstancedSpritesSupported(void) {
+  int version = rlGetVersion();
+  return version == RL_OPENGL_33 || version == RL_OPENGL_43;
+}
+
+// texture holds framesCount frames side by side
+INSTANCEDSPRITESDEF InstancedSprites LoadInstancedSprites(Texture2D texture,
+                                                          int framesCount) {
+  LoadInstancedSpritesShader();
+  InstancedSprites sprites = {.texture = texture,
+                              .framesCount = framesCount,
+                              .instancesCapacity = 256};
+  sprites.instances = (SpriteInstance *)calloc(sprites.instancesCapacity,
+                                               sizeof(SpriteInstance));
+  // Two triangles of a unit quad, scaled to the frame size by the shader
+  const float quad[12] = {0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+                          0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f};
+  sprites.vaoId = rlLoadVertexArray();
+  rlEnableVertexArray(sprites.vaoId);
+  sprites.quadVboId = rlLoadVertexBuffer(quad, sizeof(quad), false);
+  rlSetVertexAttribute(instancedSpritesShader.vertexPositionLocation, 2,
+                       RL_FLOAT, false, 0, 0);
+  rlEnableVertexAttribute(instancedSpritesShader.vertexPositionLocation);
+  LoadInstancesBuffer(&sprites);
+  rlDisableVertexArray();
+  return sprites;
+}
+
+INSTANCEDSPRITESDEF void UnloadInstancedSprites(InstancedSprites *sprites) {
+  rlUnloadVertexArray(sprites->vaoId);
+  rlUnloadVertexBuffer(sprites->quadVboId);
+  rlUnloadVertexBuffer(sprites->instancesVboId);
+  free(sprites->instances);
+  *sprites = (InstancedSprites){0};
+  UnloadInstancedSpritesShader();
+}
+
+// Starts a new frame, instances must then be added in the same order as in
+// the previous frames to avoid uploads
+INSTANCEDSPRITESDEF void BeginSpriteInstances(InstancedSprites *sprites) {
+  sprites->nextInstance = 0;
+  sprites->nextRunStart = 0;
+}
+
+INSTANCEDSPRITESDEF void AddSpriteInstance(InstancedSprites *sprites,
+                                           SpriteInstance instance) {
+  int index = sprites->nextInstance++;
+  if (index >= sprites->instancesCapacity) {
+    sprites->instancesCapacity *= 2;
+    sprites->instances = (SpriteInstance *)realloc(
+        sprites->instances,
+        sprites->instancesCapacity * sizeof(SpriteInstance));
+  }
+  if (index < sprites->instancesCount &&
+      memcmp(&sprites->instances[index], &instance, sizeof(instance)) == 0)
+    return;
+  sprites->instances[index] = instance;
+  if (sprites->dirtyStart == sprites->dirtyEnd) {
+    sprites->dirtyStart = index;
+    sprites->dirtyEnd = index + 1;
+  } else {
+    if (index < sprites->dirtyStart)
+      sprites->dirtyStart = index;
+    if (index >= sprites->dirtyEnd)
+      sprites->dirtyEnd = index + 1;
+  }
+}
+
+// Draws the instances added since the previous run of the frame, or since
+// BeginSpriteInstances, in 2D mode
+INSTANCEDSPRITESDEF void DrawInstancedSprites(InstancedSprites *sprites) {
+  int runStart = sprites->nextRunStart;
+  int runCount = sprites->nextInstance - runStart;
+  if (runCount == 0)
+    return;
+  sprites->nextRunStart = sprites->nextInstance;
+  // Those past the frame stay in both buffers, the next frames may add the
+  // same ones again
+  if (sprites->nextInstance > sprites->instancesCount)
+    sprites->instancesCount = sprites->nextInstance;
+  // What was drawn before must stay below the sprites
+  rlDrawRenderBatchActive();
+
+  rlEnableVertexArray(sprites->vaoId);
+  if (sprites->gpuCapacity < sprites->instancesCapacity) {
+    // Grown: the new buffer gets every instance at once
+    rlUnloadVertexBuffer(sprites->instancesVboId);
+    LoadInstancesBuffer(sprites);
+  } else if (sprites->dirtyStart < sprites->dirtyEnd) {
+    rlUpdateVertexBuffer(
+        sprites->instancesVboId, sprites->instances + sprites->dirtyStart,
+        (sprites->dirtyEnd - sprites->dirtyStart) * sizeof(SpriteInstance),
+        sprites->dirtyStart * sizeof(SpriteInstance));
+  }
+  sprites->dirtyStart = sprites->dirtyEnd = 0;
+
+  float frameSize[2] = {(float)sprites->texture.width / sprites->framesCount,
+                        (float)sprites->texture.height};
+  float framesCount = sprites->framesCount;
+  int textureSlot = 0;
+  rlEnableShader(instancedSpritesShader.id);
+  rlSetUniformMatrix(instancedSpritesShader.projectionLocation,
+                     rlGetMatrixProjection());
+  rlSetUniformMatrix(instancedSpritesShader.modelviewLocation,
+                     rlGetMatrixModelview());
+  rlSetUniform(instancedSpritesShader.frameSizeLocation, frameSize,
+               RL_SHADER_UNIFORM_VEC2, 1);
+  rlSetUniform(instancedSpritesShader.framesCountLocation, &framesCount,
+               RL_SHADER_UNIFORM_FLOAT, 1);
+  rlSetUniform(instancedSpritesShader.textureLocation, &textureSlot,
+               RL_SHADER_UNIFORM_INT, 1);
+  rlActiveTextureSlot(textureSlot);
+  rlEnableTexture(sprites->texture.id);
+  SetInstancesAttributes(sprites, runStart);
+  rlDrawVertexArrayInstanced(0, 6, runCount);
+  rlDisableTexture();
+  rlDisableVertexArray();
+  rlDisableShader();
+}
+
+#endif // INSTANCED_SPRITES_H
@@ -0,0 +1,425 @@
+
+#ifndef JOBS_H
+#define JOBS_H
+
+// Small work-stealing job system.
+//
+// Every thread that submits work owns a Chase-Lev deque: it pushes and pops
+// at the bottom while idle workers steal from the top. Threads waiting on a
+// group help executing jobs instead of blocking, so the main thread is never
+// idle while its own work is pending.
+//
+// Define JOBS_NO_THREADS (done automatically on web builds without pthreads
+// and on MSVC) to run every job on the thread that waits for it. The atomics
+// and thread locals are still used then: MSVC needs /std:c11 and
+// /experimental:c11atomics, as set in the VS2022 project.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(PLATFORM_WEB) && !defined(__EMSCRIPTEN_PTHREADS__)) ||           \
+    defined(_MSC_VER)
+#define JOBS_NO_THREADS
+#endif
+
+#if !defined(JOBS_NO_THREADS)
+#include <pthread.h>
+#include <sched.h>
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+#endif
+
+#ifndef JOBSDEF
+#define JOBSDEF // Functions defined as 'extern' by default (implicit
+                // specifiers)
+#endif
+
+#define JOBS_MAX_THREADS 32
+#define JOBS_DEQUE_SIZE 4096 // Power of two
+#define JOBS_POOL_SIZE 4096  // Power of two, jobs in flight per thread
+#define JOBS_MAX_CONTINUATIONS 8
+#define JOBS_SPIN_COUNT 64
+
+typedef void (*JobFunction)(void *data);
+typedef void (*JobRangeFunction)(void *data, int start, int end);
+
+// Counts the jobs still running for a batch of work
+typedef struct JobGroup {
+  atomic_int pending;
+} JobGroup;
+
+typedef struct Job {
+  JobFunction function;
+  JobRangeFunction rangeFunction;
+  void *data;
+  int start;
+  int end;
+  int grainSize;
+  JobGroup *group;
+  // Starts at 1 (held until submitted) + 1 per unfinished dependency
+  atomic_int unfinishedDependencies;
+  atomic_bool isPending; // From allocation until finished, holds the slot
+  int continuationsCount;
+  struct Job *continuations[JOBS_MAX_CONTINUATIONS];
+} Job;
+
+typedef struct JobDeque {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(Job *) buffer[JOBS_DEQUE_SIZE];
+} JobDeque;
+
+typedef struct JobThreadState {
+  JobDeque deque;
+  Job pool[JOBS_POOL_SIZE];
+  unsigned int poolIndex;
+  unsigned int randomState;
+} JobThreadState;
+
+static JobThreadState *jobThreads = NULL;
+static atomic_int jobThreadsCount = 0;
+static int jobWorkersCount = 0;
+static _Thread_local int jobThreadIndex = -1;
+#if !defined(JOBS_NO_THREADS)
+static atomic_bool jobsRunning = false;
+static pthread_t jobWorkers[JOBS_MAX_THREADS];
+static pthread_mutex_t jobSleepMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobSleepCondition = PTHREAD_COND_INITIALIZER;
+static atomic_int jobSleepersCount = 0;
+static atomic_uint jobWorkGeneration = 0;
+#endif
+
+// DEQUE
+
+static bool JobDequePush(JobDeque *deque, Job *job) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  if (bottom - top >= JOBS_DEQUE_SIZE)
+    return false;
+  atomic_store_explicit(&deque->buffer[bottom & (JOBS_DEQUE_SIZE - 1)], job,
+                        memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+  return true;
+}
+
+static Job *JobDequePop(JobDeque *deque) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+  Job *job = atomic_load_explicit(
+      &deque->buffer[bottom & (JOBS_DEQUE_SIZE - 1)], memory_order_relaxed);
+  if (top == bottom) {
+    // Last job: race against thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      job = NULL;
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return job;
+}
+
+static Job *JobDequeSteal(JobDeque *deque) {
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom)
+    return NULL;
+  Job *job = atomic_load_explicit(&deque->buffer[top & (JOBS_DEQUE_SIZE - 1)],
+                                  memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed))
+    return NULL;
+  return job;
+}
+
+// SCHEDULING
+
+static void JobsExecute(Job *job);
+
+static JobThreadState *JobsGetThreadState(void) {
+  if (jobThreadIndex < 0) {
+    // Lazily give a deque to any thread submitting work
+    jobThreadIndex = atomic_fetch_add(&jobThreadsCount, 1);
+    if (jobThreadIndex >= JOBS_MAX_THREADS)
+      abort();
+    jobThreads[jobThreadIndex].randomState = 2463534242u + jobThreadIndex;
+  }
+  return &jobThreads[jobThreadIndex];
+}
+
+static void JobsWakeWorkers(void) {
+#if !defined(JOBS_NO_THREADS)
+  atomic_fetch_add(&jobWorkGeneration, 1);
+  if (atomic_load(&jobSleepersCount) > 0) {
+    pthread_mutex_lock(&jobSleepMutex);
+    pthread_cond_broadcast(&jobSleepCondition);
+    pthread_mutex_unlock(&jobSleepMutex);
+  }
+#endif
+}
+
+static void JobsPush(Job *job) {
+  JobThreadState *state = JobsGetThreadState();
+  if (!JobDequePush(&state->deque, job)) {
+    // Deque full: keep going by running the job right away
+    JobsExecute(job);
+    return;
+  }
+  JobsWakeWorkers();
+}
+
+static Job *JobsFindWork(void) {
+  JobThreadState *state = JobsGetThreadState();
+  Job *job = JobDequePop(&state->deque);
+  if (job)
+    return job;
+  int threadsCount = atomic_load(&jobThreadsCount);
+  if (threadsCount <= 1)
+    return NULL;
+  // xorshift to pick a random victim, then sweep all of them once
+  unsigned int random = state->randomState;
+  random ^= random << 13;
+  random ^= random >> 17;
+  random ^= random << 5;
+  state->randomState = random;
+  for (int i = 0; i < threadsCount; i++) {
+    int victim = (random + i) % threadsCount;
+    if (victim == jobThreadIndex)
+      continue;
+    job = JobDequeSteal(&jobThreads[victim].deque);
+    if (job)
+      return job;
+  }
+  return NULL;
+}
+
+// Takes the next slot of the pool whose job finished. When every job of the
+// pool is still in flight, runs pending ones until a slot frees up.
+static Job *JobsAllocate(void) {
+  JobThreadState *state = JobsGetThreadState();
+  for (int i = 1;; i++) {
+    Job *job = &state->pool[state->poolIndex++ & (JOBS_POOL_SIZE - 1)];
+    if (!atomic_load_explicit(&job->isPending, memory_order_acquire)) {
+      memset(job, 0, sizeof(Job));
+      atomic_init(&job->unfinishedDependencies, 1);
+      atomic_init(&job->isPending, true);
+      return job;
+    }
+    if (i % JOBS_POOL_SIZE == 0) {
+      Job *work = JobsFindWork();
+      if (work)
+        JobsExecute(work);
+#if !defined(JOBS_NO_THREADS)
+      else
+        sched_yield();
+#endif
+    }
+  }
+}
+
+static void JobsFinish(Job *job) {
+  for (int i = 0; i < job->continuationsCount; i++) {
+    Job *continuation = job->continuations[i];
+    if (atomic_fetch_sub(&continuation->unfinishedDependencies, 1) == 1)
+      JobsPush(continuation);
+  }
+  if (job->group)
+    atomic_fetch_sub_explicit(&job->group->pending, 1, memory_order_release);
+  // Last access: the slot can be reused from now on
+  atomic_store_explicit(&job->isPending, false, memory_order_release);
+}
+
+static void JobsExecute(Job *job) {
+  if (job->rangeFunction) {
+    // Split big ranges in halves so idle workers can steal the other half
+    while (job->end - job->start > job->grainSize) {
+      int middle = job->start + (job->end - job->start) / 2;
+      Job *half = JobsAllocate();
+      half->rangeFunction = job->rangeFunction;
+      half->data = job->data;
+      half->start = middle;
+      half->end = job->end;
+      half->grainSize = job->grainSize;
+      half->group = job->group;
+      atomic_fetch_add(&job->group->pending, 1);
+      atomic_store(&half->unfinishedDependencies, 0);
+      JobsPush(half);
+      job->end = middle;
+    }
+    job->rangeFunction(job->data, job->start, job->end);
+  } else {
+    job->function(job->data);
+  }
+  JobsFinish(job);
+}
+
+#if !defined(JOBS_NO_THREADS)
+static void *JobsWorkerLoop(void *argument) {
+  (void)argument;
+  JobsGetThreadState();
+  int idleSpins = 0;
+  while (atomic_load_explicit(&jobsRunning, memory_order_relaxed)) {
+    unsigned int generation = atomic_load(&jobWorkGeneration);
+    Job *job = JobsFindWork();
+    if (job) {
+      JobsExecute(job);
+      idleSpins = 0;
+      continue;
+    }
+    if (++idleSpins < JOBS_SPIN_COUNT) {
+      sched_yield();
+      continue;
+    }
+    // Nothing pushed since the scan started: sleep until the next push
+    pthread_mutex_lock(&jobSleepMutex);
+    atomic_fetch_add(&jobSleepersCount, 1);
+    if (atomic_load(&jobWorkGeneration) == generation &&
+        atomic_load(&jobsRunning))
+      pthread_cond_wait(&jobSleepCondition, &jobSleepMutex);
+    atomic_fetch_sub(&jobSleepersCount, 1);
+    pthread_mutex_unlock(&jobSleepMutex);
+    idleSpins = 0;
+  }
+  return NULL;
+}
+#endif
+
+// PUBLIC API
+
+// Number of hardware threads, at least 1
+JOBSDEF int JobsGetCoresCount(void) {
+#if defined(JOBS_NO_THREADS)
+  return 1;
+#elif defined(_WIN32)
+  const char *processors = getenv("NUMBER_OF_PROCESSORS");
+  int count = processors ? atoi(processors) : 1;
+  return count > 0 ? count : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Starts the workers. A negative count uses one worker per spare core. The
+// calling thread takes part in the work whenever it waits on a group.
+JOBSDEF void JobsInit(int workersCount) {
+  jobThreads =
+      (JobThreadState *)calloc(JOBS_MAX_THREADS, sizeof(JobThreadState));
+  atomic_store(&jobThreadsCount, 0);
+  jobThreadIndex = -1;
+  JobsGetThreadState();
+#if defined(JOBS_NO_THREADS)
+  (void)workersCount;
+  jobWorkersCount = 0;
+#else
+  if (workersCount < 0)
+    workersCount = JobsGetCoresCount() - 1;
+  if (workersCount > JOBS_MAX_THREADS / 2)
+    workersCount = JOBS_MAX_THREADS / 2;
+  jobWorkersCount = workersCount;
+  atomic_store(&jobsRunning, true);
+  for (int i = 0; i < jobWorkersCount; i++) {
+    pthread_create(&jobWorkers[i], NULL, JobsWorkerLoop, NULL);
+  }
+#endif
+}
+
+JOBSDEF void JobsShutdown(void) {
+  if (!jobThreads)
+    return;
+#if !defined(JOBS_NO_THREADS)
+  atomic_store(&jobsRunning, false);
+  pthread_mutex_lock(&jobSleepMutex);
+  pthread_cond_broadcast(&jobSleepCondition);
+  pthread_mutex_unlock(&jobSleepMutex);
+  for (int i = 0; i < jobWorkersCount; i++) {
+    pthread_join(jobWorkers[i], NULL);
+  }
+#endif
+  jobWorkersCount = 0;
+  jobThreadIndex = -1;
+  free(jobThreads);
+  jobThreads = NULL;
+}
+
+// Threads that execute jobs, counting the one waiting on groups
+JOBSDEF int JobsGetThreadsCount(void) { return jobWorkersCount + 1; }
+
+// Creates a job that runs once submitted and all its dependencies finished.
+// The group, if any, is counted as pending right away.
+JOBSDEF Job *JobsCreate(JobFunction function, void *data, JobGroup *group) {
+  Job *job = JobsAllocate();
+  job->function = function;
+  job->data = data;
+  job->group = group;
+  if (group)
+    atomic_fetch_add(&group->pending, 1);
+  return job;
+}
+
+// Job will not start before dependency finished. Must be called before
+// dependency is submitted.
+JOBSDEF void JobsAddDependency(Job *job, Job *dependency) {
+  if (dependency->continuationsCount >= JOBS_MAX_CONTINUATIONS)
+    abort();
+  atomic_fetch_add(&job->unfinishedDependencies, 1);
+  dependency->continuations[dependency->continuationsCount++] = job;
+}
+
+JOBSDEF void JobsSubmit(Job *job) {
+  if (atomic_fetch_sub(&job->unfinishedDependencies, 1) == 1)
+    JobsPush(job);
+}
+
+JOBSDEF void JobsRun(JobFunction function, void *data, JobGroup *group) {
+  JobsSubmit(JobsCreate(function, data, group));
+}
+
+// Calls function on [start, end) sub ranges of at most grainSize items
+JOBSDEF void JobsParallelFor(int count, int grainSize,
+                             JobRangeFunction function, void *data,
+                             JobGroup *group) {
+  if (count <= 0)
+    return;
+  if (grainSize < 1)
+    grainSize = 1;
+  Job *job = JobsAllocate();
+  job->rangeFunction = function;
+  job->data = data;
+  job->start = 0;
+  job->end = count;
+  job->grainSize = grainSize;
+  job->group = group;
+  atomic_fetch_add(&group->pending, 1);
+  JobsSubmit(job);
+}
+
+JOBSDEF bool JobsIsDone(JobGroup *group) {
+  return atomic_load_explicit(&group->pending, memory_order_acquire) == 0;
+}
+
+// Runs pending jobs on the calling thread until every job of group finished
+JOBSDEF void JobsWait(JobGroup *group) {
+  while (!JobsIsDone(group)) {
+    Job *job = JobsFindWork();
+    if (job) {
+      JobsExecute(job);
+    } else {
+#if !defined(JOBS_NO_THREADS)
+      sched_yield();
+#endif
+    }
+  }
+}
+
+#endif // JOBS_H
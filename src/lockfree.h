@@ -0,0 +1,118 @@
+
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+// Lock-free primitives to hand data over between two threads.
+//
+// TripleBuffer: one writer publishes whole states, one reader always gets the
+// latest complete one. Neither side ever waits for the other.
+// SpscQueue: bounded single producer, single consumer FIFO of fixed size
+// items.
+//
+// MSVC needs /std:c11 and /experimental:c11atomics, as set in the VS2022
+// project.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef LOCKFREEDEF
+#define LOCKFREEDEF // Functions defined as 'extern' by default (implicit
+                    // specifiers)
+#endif
+
+// TRIPLE BUFFER
+
+#define TRIPLE_BUFFER_FRESH 4 // Set on middle when the writer published
+
+// Only indices are swapped, buffers themselves are owned by the caller
+typedef struct TripleBuffer {
+  atomic_int middle;
+  int back;  // Owned by the writer
+  int front; // Owned by the reader
+} TripleBuffer;
+
+LOCKFREEDEF void TripleBufferInit(TripleBuffer *buffer) {
+  buffer->front = 0;
+  atomic_init(&buffer->middle, 1);
+  buffer->back = 2;
+}
+
+// Index of the buffer the writer is allowed to fill
+LOCKFREEDEF int TripleBufferGetBack(TripleBuffer *buffer) {
+  return buffer->back;
+}
+
+// Hands the filled back buffer to the reader and takes the middle one back.
+// Returns false when the reader skipped the buffer taken back, true when it
+// was read at some point (the writer can then drop what it kept for it).
+LOCKFREEDEF bool TripleBufferPublish(TripleBuffer *buffer) {
+  int previous = atomic_exchange_explicit(
+      &buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH,
+      memory_order_acq_rel);
+  buffer->back = previous & ~TRIPLE_BUFFER_FRESH;
+  return !(previous & TRIPLE_BUFFER_FRESH);
+}
+
+// Index of the latest published buffer, stable until the next acquire
+LOCKFREEDEF int TripleBufferAcquire(TripleBuffer *buffer) {
+  if (atomic_load_explicit(&buffer->middle, memory_order_relaxed) &
+      TRIPLE_BUFFER_FRESH) {
+    int previous = atomic_exchange_explicit(&buffer->middle, buffer->front,
+                                            memory_order_acq_rel);
+    buffer->front = previous & ~TRIPLE_BUFFER_FRESH;
+  }
+  return buffer->front;
+}
+
+// SPSC QUEUE
+
+typedef struct SpscQueue {
+  atomic_uint head; // Next item to pop, written by the consumer
+  atomic_uint tail; // Next free slot, written by the producer
+  unsigned int capacity;
+  size_t itemSize;
+  unsigned char *items;
+} SpscQueue;
+
+// capacity must be a power of two
+LOCKFREEDEF void SpscQueueInit(SpscQueue *queue, unsigned int capacity,
+                               size_t itemSize) {
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->capacity = capacity;
+  queue->itemSize = itemSize;
+  queue->items = (unsigned char *)malloc(capacity * itemSize);
+}
+
+LOCKFREEDEF void SpscQueueFree(SpscQueue *queue) {
+  free(queue->items);
+  queue->items = NULL;
+}
+
+// Returns false when the queue is full
+LOCKFREEDEF bool SpscQueuePush(SpscQueue *queue, const void *item) {
+  unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head >= queue->capacity)
+    return false;
+  memcpy(queue->items + (tail & (queue->capacity - 1)) * queue->itemSize, item,
+         queue->itemSize);
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+// Returns false when the queue is empty
+LOCKFREEDEF bool SpscQueuePop(SpscQueue *queue, void *item) {
+  unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail)
+    return false;
+  memcpy(item, queue->items + (head & (queue->capacity - 1)) * queue->itemSize,
+         queue->itemSize);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+#endif // LOCKFREE_H
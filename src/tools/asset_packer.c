@@ -0,0 +1,257 @@
+// Decodes every PNG of the assets directory into one asset pack, loaded by
+// the game instead of the PNGs when present. Pixels are stored as RGBA8 so
+// they are uploaded as is, and sprites also block compressed, DXT1 when
+// opaque and DXT5 otherwise, which the game prefers when the GPU supports
+// S3TC. Only DXT is written: desktop GPUs and browsers have S3TC, while GPUs
+// without it, most mobile GLES ones, load the RGBA8 entries. ETC2 would cover
+// those and is left out for the size of its encoder.
+//
+// Build: make asset_packer (from src/), or make assets.pack to also run it
+// Usage: ./asset_packer [assets directory] [pack file]
+
+#include "../asset_pack.h"
+#include "raylib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tiles are not compressed: their size defines the map grid, which padding
+// would change, and block artifacts would show at their seams
+#define UNCOMPRESSED_ASSETS_PATH "assets/map/"
+
+static int CompareEntries(const void *a, const void *b) {
+  const AssetPackEntry *entryA = (const AssetPackEntry *)a;
+  const AssetPackEntry *entryB = (const AssetPackEntry *)b;
+  int order = strcmp(entryA->name, entryB->name);
+  return order ? order : entryA->format - entryB->format;
+}
+
+// DXT COMPRESSION
+//
+// Range fit: the endpoints of a block are the corners of the bounding box
+// of its colors, and of its alpha values, every texel then takes the
+// nearest of the interpolated values. Fast and good enough for sprites.
+
+static uint16_t ToRgb565(const int *rgb) {
+  return ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3);
+}
+
+static void FromRgb565(uint16_t color, int *rgb) {
+  int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// 8 bytes: two RGB565 endpoints then 2 bits per texel, always in the four
+// colors mode. Fully transparent texels do not count in the bounding box.
+static void CompressColorBlock(unsigned char texels[16][4],
+                               unsigned char *block) {
+  int minimum[3] = {255, 255, 255}, maximum[3] = {0, 0, 0};
+  bool isTransparent = true;
+  for (int i = 0; i < 16; i++) {
+    isTransparent = isTransparent && texels[i][3] == 0;
+  }
+  for (int i = 0; i < 16; i++) {
+    if (texels[i][3] == 0 && !isTransparent)
+      continue;
+    for (int c = 0; c < 3; c++) {
+      if (texels[i][c] < minimum[c])
+        minimum[c] = texels[i][c];
+      if (texels[i][c] > maximum[c])
+        maximum[c] = texels[i][c];
+    }
+  }
+  uint16_t color0 = ToRgb565(maximum), color1 = ToRgb565(minimum);
+  int palette[4][3];
+  FromRgb565(color0, palette[0]);
+  FromRgb565(color1, palette[1]);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+  }
+  uint32_t indices = 0;
+  for (int i = 0; i < 16 && color0 != color1; i++) {
+    int best = 0, bestDistance = 1 << 30;
+    for (int p = 0; p < 4; p++) {
+      int distance = 0;
+      for (int c = 0; c < 3; c++) {
+        int delta = texels[i][c] - palette[p][c];
+        distance += delta * delta;
+      }
+      if (distance < bestDistance) {
+        best = p;
+        bestDistance = distance;
+      }
+    }
+    indices |= (uint32_t)best << (2 * i);
+  }
+  // Four colors mode needs color0 > color1, max >= min already ensures >=
+  block[0] = color0 & 0xFF;
+  block[1] = color0 >> 8;
+  block[2] = color1 & 0xFF;
+  block[3] = color1 >> 8;
+  for (int i = 0; i < 4; i++) {
+    block[4 + i] = (indices >> (8 * i)) & 0xFF;
+  }
+}
+
+// 8 bytes: two alpha endpoints then 3 bits per texel, in the eight values
+// mode
+static void CompressAlphaBlock(unsigned char texels[16][4],
+                               unsigned char *block) {
+  int minimum = 255, maximum = 0;
+  for (int i = 0; i < 16; i++) {
+    if (texels[i][3] < minimum)
+      minimum = texels[i][3];
+    if (texels[i][3] > maximum)
+      maximum = texels[i][3];
+  }
+  int palette[8] = {maximum, minimum};
+  for (int p = 1; p < 7; p++) {
+    palette[p + 1] = ((7 - p) * maximum + p * minimum) / 7;
+  }
+  uint64_t indices = 0;
+  for (int i = 0; i < 16 && maximum != minimum; i++) {
+    int best = 0, bestDistance = 256;
+    for (int p = 0; p < 8; p++) {
+      int distance = abs(texels[i][3] - palette[p]);
+      if (distance < bestDistance) {
+        best = p;
+        bestDistance = distance;
+      }
+    }
+    indices |= (uint64_t)best << (3 * i);
+  }
+  block[0] = maximum;
+  block[1] = minimum;
+  for (int i = 0; i < 6; i++) {
+    block[2 + i] = (indices >> (8 * i)) & 0xFF;
+  }
+}
+
+// image must be RGBA8 and its width a multiple of 4. Its height is padded
+// to a multiple of 4 with transparent rows, returned in *paddedHeight.
+// Returns the compressed size, *data is allocated.
+static int CompressDxt(Image image, int format, int *paddedHeight,
+                       unsigned char **data) {
+  bool hasAlpha = format != PIXELFORMAT_COMPRESSED_DXT1_RGB;
+  int blockSize = hasAlpha ? 16 : 8;
+  int blocksWidth = image.width / 4, blocksHeight = (image.height + 3) / 4;
+  int size = blocksWidth * blocksHeight * blockSize;
+  *data = (unsigned char *)malloc(size);
+  *paddedHeight = blocksHeight * 4;
+  const unsigned char *pixels = (const unsigned char *)image.data;
+  unsigned char *block = *data;
+  for (int by = 0; by < blocksHeight; by++) {
+    for (int bx = 0; bx < blocksWidth; bx++) {
+      unsigned char texels[16][4] = {0};
+      for (int i = 0; i < 16; i++) {
+        int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+        if (y < image.height)
+          memcpy(texels[i], pixels + (y * image.width + x) * 4, 4);
+      }
+      if (hasAlpha) {
+        CompressAlphaBlock(texels, block);
+        block += 8;
+      }
+      CompressColorBlock(texels, block);
+      block += 8;
+    }
+  }
+  return size;
+}
+
+static bool IsOpaque(Image image) {
+  const unsigned char *pixels = (const unsigned char *)image.data;
+  for (int i = 0; i < image.width * image.height; i++) {
+    if (pixels[i * 4 + 3] != 255)
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *assetsPath = argc > 1 ? argv[1] : "assets";
+  const char *packFileName = argc > 2 ? argv[2] : "assets.pack";
+  SetTraceLogLevel(LOG_WARNING);
+
+  FilePathList files = LoadDirectoryFilesEx(assetsPath, ".png", true);
+  // Up to two entries per file, RGBA8 and compressed
+  AssetPackEntry *entries = (AssetPackEntry *)calloc(
+      files.count ? 2 * files.count : 1, sizeof(AssetPackEntry));
+  Image *images = (Image *)calloc(files.count ? files.count : 1,
+                                  sizeof(Image));
+  int imagesCount = 0;
+  int entriesCount = 0;
+  long rawSize = 0;
+  long compressedSize = 0; // RGBA8 size of the compressed images
+  for (unsigned int i = 0; i < files.count; i++) {
+    Image image = LoadImage(files.paths[i]);
+    if (!image.data) {
+      fprintf(stderr, "Could not decode %s\n", files.paths[i]);
+      return 1;
+    }
+    ImageFormat(&image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    // Names are looked up with forward slashes on every platform
+    char *name = strdup(files.paths[i]);
+    for (char *c = name; *c; c++) {
+      if (*c == '\\')
+        *c = '/';
+    }
+    images[imagesCount++] = image;
+    entries[entriesCount++] = (AssetPackEntry){
+        .name = name,
+        .width = image.width,
+        .height = image.height,
+        .format = image.format,
+        .mipmaps = image.mipmaps,
+        .data = (const unsigned char *)image.data,
+        .dataSize = GetPixelDataSize(image.width, image.height, image.format)};
+    rawSize += entries[entriesCount - 1].dataSize;
+
+    if (image.width % 4 != 0 ||
+        strncmp(name, UNCOMPRESSED_ASSETS_PATH,
+                strlen(UNCOMPRESSED_ASSETS_PATH)) == 0)
+      continue;
+    int format = IsOpaque(image) ? PIXELFORMAT_COMPRESSED_DXT1_RGB
+                                 : PIXELFORMAT_COMPRESSED_DXT5_RGBA;
+    AssetPackEntry compressed = {
+        .name = strdup(name), .width = image.width, .format = format,
+        .mipmaps = 1};
+    unsigned char *data = NULL;
+    compressed.dataSize = CompressDxt(image, format, &compressed.height, &data);
+    compressed.data = data;
+    entries[entriesCount++] = compressed;
+    compressedSize += compressed.dataSize;
+    printf("%s: %s %dx%d, %.1f MB -> %.1f MB\n", name,
+           format == PIXELFORMAT_COMPRESSED_DXT1_RGB ? "DXT1" : "DXT5",
+           compressed.width, compressed.height,
+           GetPixelDataSize(image.width, image.height, image.format) /
+               (1024.0 * 1024.0),
+           compressed.dataSize / (1024.0 * 1024.0));
+  }
+  // Same file whatever the directory listing order
+  qsort(entries, entriesCount, sizeof(AssetPackEntry), CompareEntries);
+
+  bool isWritten = WriteAssetPack(packFileName, entries, entriesCount);
+  if (isWritten) {
+    printf("%s: %d images, %.1f MB of RGBA8 pixels, %.1f MB compressed\n",
+           packFileName, imagesCount, rawSize / (1024.0 * 1024.0),
+           compressedSize / (1024.0 * 1024.0));
+  } else {
+    fprintf(stderr, "Could not write %s\n", packFileName);
+  }
+  for (int i = 0; i < entriesCount; i++) {
+    free((char *)entries[i].name);
+    if (entries[i].format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8)
+      free((void *)entries[i].data); // The others are the images pixels
+  }
+  for (int i = 0; i < imagesCount; i++) {
+    UnloadImage(images[i]);
+  }
+  free(entries);
+  free(images);
+  UnloadDirectoryFiles(files);
+  return isWritten ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+// Micro-benchmark of the job system: scheduling overhead per job and
+// parallel-for scaling from 1 to 16 threads.
+//
+// Build: make jobs_bench (from src/)
+// Usage: ./jobs_bench [jobs count] [max threads]
+
+#include "../jobs.h"
+#include "../perlin.h"
+#include <stdio.h>
+#include <time.h>
+
+#define NOISE_SIZE 1024
+
+static float noise[NOISE_SIZE * NOISE_SIZE];
+static atomic_int emptyJobsDone = 0;
+
+static double Now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void EmptyJob(void *data) {
+  (void)data;
+  atomic_fetch_add_explicit(&emptyJobsDone, 1, memory_order_relaxed);
+}
+
+static void NoiseRows(void *data, int start, int end) {
+  (void)data;
+  for (int j = start; j < end; j++) {
+    for (int i = 0; i < NOISE_SIZE; i++) {
+      noise[j * NOISE_SIZE + i] = perlin2D_octaves(i * 0.1f, j * 0.1f, 4, 0.5f);
+    }
+  }
+}
+
+static void DependentJob(void *data) { (*(int *)data)++; }
+
+// Submits jobs by batches below the pool size and returns ns per job
+static double MeasureOverhead(int jobsCount) {
+  atomic_store(&emptyJobsDone, 0);
+  double start = Now();
+  for (int submitted = 0; submitted < jobsCount;) {
+    JobGroup group = {0};
+    int batch = jobsCount - submitted;
+    if (batch > JOBS_POOL_SIZE / 2)
+      batch = JOBS_POOL_SIZE / 2;
+    for (int i = 0; i < batch; i++) {
+      JobsRun(EmptyJob, NULL, &group);
+    }
+    JobsWait(&group);
+    submitted += batch;
+  }
+  double elapsed = Now() - start;
+  if (atomic_load(&emptyJobsDone) != jobsCount) {
+    fprintf(stderr, "lost jobs: %i/%i\n", atomic_load(&emptyJobsDone),
+            jobsCount);
+    exit(1);
+  }
+  return elapsed * 1e9 / jobsCount;
+}
+
+static double MeasureNoise(int grainSize) {
+  JobGroup group = {0};
+  double start = Now();
+  JobsParallelFor(NOISE_SIZE, grainSize, NoiseRows, NULL, &group);
+  JobsWait(&group);
+  double elapsed = (Now() - start) * 1000.0;
+  // Read the results back so the noise is not optimized away
+  float checksum = 0.0f;
+  for (int i = 0; i < NOISE_SIZE * NOISE_SIZE; i++) {
+    checksum += noise[i];
+  }
+  if (checksum != checksum)
+    printf("invalid noise\n");
+  return elapsed;
+}
+
+// A chain of jobs which must run in order
+static bool CheckDependencies(void) {
+  int counter = 0;
+  JobGroup group = {0};
+  Job *previous = JobsCreate(DependentJob, &counter, &group);
+  Job *first = previous;
+  for (int i = 1; i < JOBS_MAX_CONTINUATIONS; i++) {
+    Job *job = JobsCreate(DependentJob, &counter, &group);
+    JobsAddDependency(job, previous);
+    JobsSubmit(job);
+    previous = job;
+  }
+  JobsSubmit(first);
+  JobsWait(&group);
+  return counter == JOBS_MAX_CONTINUATIONS;
+}
+
+int main(int argc, char **argv) {
+  int jobsCount = argc > 1 ? atoi(argv[1]) : 200000;
+  int maxThreads = argc > 2 ? atoi(argv[2]) : 16;
+  perlin_init(42);
+
+  printf("cores: %i\n", JobsGetCoresCount());
+  printf("%8s %14s %14s %10s\n", "threads", "ns/empty job", "noise ms",
+         "speedup");
+  double singleThreadNoise = 0.0;
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    JobsInit(threads - 1);
+    if (!CheckDependencies()) {
+      fprintf(stderr, "dependencies ran out of order\n");
+      return 1;
+    }
+    MeasureNoise(8); // Warm up
+    double overhead = MeasureOverhead(jobsCount);
+    double noiseTime = MeasureNoise(8);
+    if (threads == 1)
+      singleThreadNoise = noiseTime;
+    printf("%8i %14.1f %14.2f %9.2fx\n", threads, overhead, noiseTime,
+           singleThreadNoise / noiseTime);
+    JobsShutdown();
+  }
+  return 0;
+}
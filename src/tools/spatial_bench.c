@@ -0,0 +1,191 @@
+// Micro-benchmark of the spatial grid: rectangle, radius and nearest queries,
+// unbounded or within a radius, among 100k items spread over a map of the default size, against scans of
+// every item, which also check the results of the grid.
+//
+// Build: make spatial_bench (from src/)
+// Usage: ./spatial_bench [items count] [queries count]
+
+#include "../spatial_grid.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define WORLD_WIDTH 150000.0f // About the default map, in world units
+#define WORLD_HEIGHT 75000.0f
+#define CELL_SIZE 1024.0f
+#define TYPES_COUNT 4
+#define QUERY_MASK 0x5u // Half of the types
+#define RECTANGLE_SIZE 3000.0f
+#define RADIUS 1500.0f
+#define RESULTS_CAPACITY 4096
+
+typedef enum QueryType {
+  QUERY_RECTANGLE,
+  QUERY_RADIUS,
+  QUERY_NEAREST_1,
+  QUERY_NEAREST_16,
+  QUERY_NEAREST_IN_RADIUS,
+  QUERY_TYPES_COUNT
+} QueryType;
+
+static const char *queryTypesName[QUERY_TYPES_COUNT] = {
+    "rectangle", "radius", "nearest 1", "nearest 16", "nearest in r"};
+
+static SpatialItem results[RESULTS_CAPACITY];
+static uint64_t randomState = 42;
+
+static double Now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// xorshift64, in [0, 1)
+static float Random(void) {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return (randomState >> 40) / (float)(1 << 24);
+}
+
+static int Query(SpatialGrid *grid, QueryType type, float x, float y) {
+  switch (type) {
+  case QUERY_RECTANGLE:
+    return QuerySpatialRectangle(grid, x, y, RECTANGLE_SIZE, RECTANGLE_SIZE,
+                                 QUERY_MASK, results, RESULTS_CAPACITY);
+  case QUERY_RADIUS:
+    return QuerySpatialRadius(grid, x, y, RADIUS, QUERY_MASK, results,
+                              RESULTS_CAPACITY);
+  case QUERY_NEAREST_1:
+    return QuerySpatialNearest(grid, x, y, 1, QUERY_MASK, results);
+  case QUERY_NEAREST_IN_RADIUS:
+    return QuerySpatialNearestInRadius(grid, x, y, RADIUS, 1, QUERY_MASK,
+                                       results);
+  default:
+    return QuerySpatialNearest(grid, x, y, 16, QUERY_MASK, results);
+  }
+}
+
+// Same query over every item. Returns the count, and a checksum of the ids
+// found, in order for the nearest queries.
+static int Scan(SpatialItem *items, int itemsCount, QueryType type, float x,
+                float y, uint64_t *checksum) {
+  int count = 0;
+  *checksum = 0;
+  if (type >= QUERY_NEAREST_1) {
+    // One cell holding every item
+    SpatialCell all = {items, itemsCount, itemsCount};
+    AddNearestInSpatialCell(&all, x, y, QUERY_MASK, results, &count,
+                            type == QUERY_NEAREST_16 ? 16 : 1);
+    if (type == QUERY_NEAREST_IN_RADIUS && count > 0 &&
+        GetSpatialDistance(&results[0], x, y) > RADIUS * RADIUS)
+      count = 0;
+    for (int i = 0; i < count; i++) {
+      *checksum = *checksum * 31 + results[i].id;
+    }
+    return count;
+  }
+  for (int i = 0; i < itemsCount; i++) {
+    SpatialItem *item = &items[i];
+    if (!(item->mask & QUERY_MASK))
+      continue;
+    bool isFound =
+        type == QUERY_RECTANGLE
+            ? item->x >= x && item->x <= x + RECTANGLE_SIZE && item->y >= y &&
+                  item->y <= y + RECTANGLE_SIZE
+            : GetSpatialDistance(item, x, y) <= RADIUS * RADIUS;
+    if (isFound) {
+      *checksum += item->id;
+      count++;
+    }
+  }
+  return count;
+}
+
+static uint64_t GetChecksum(QueryType type, int count) {
+  uint64_t checksum = 0;
+  for (int i = 0; i < count && i < RESULTS_CAPACITY; i++) {
+    if (type >= QUERY_NEAREST_1)
+      checksum = checksum * 31 + results[i].id;
+    else
+      checksum += results[i].id;
+  }
+  return checksum;
+}
+
+int main(int argc, char **argv) {
+  int itemsCount = argc > 1 ? atoi(argv[1]) : 100000;
+  int queriesCount = argc > 2 ? atoi(argv[2]) : 100000;
+  // Scans are slow, they run on a part of the queries only
+  int scansCount = queriesCount / 100 > 10 ? queriesCount / 100 : 10;
+
+  SpatialItem *items = (SpatialItem *)malloc(itemsCount * sizeof(SpatialItem));
+  for (int i = 0; i < itemsCount; i++) {
+    items[i] = (SpatialItem){Random() * WORLD_WIDTH, Random() * WORLD_HEIGHT,
+                             i, 1u << (i % TYPES_COUNT)};
+  }
+  float *queries = (float *)malloc(2 * queriesCount * sizeof(float));
+  for (int i = 0; i < queriesCount; i++) {
+    queries[2 * i] = Random() * WORLD_WIDTH;
+    queries[2 * i + 1] = Random() * WORLD_HEIGHT;
+  }
+
+  SpatialGrid grid =
+      CreateSpatialGrid(0.0f, 0.0f, WORLD_WIDTH, WORLD_HEIGHT, CELL_SIZE);
+  double start = Now();
+  for (int i = 0; i < itemsCount; i++) {
+    AddSpatialItem(&grid, items[i].id, items[i].x, items[i].y, items[i].mask);
+  }
+  double addTime = Now() - start;
+  printf("items: %i, cells: %ix%i of %.0f, add: %.1f ns/item\n", itemsCount,
+         grid.width, grid.height, CELL_SIZE, addTime * 1e9 / itemsCount);
+
+  printf("%12s %12s %12s %10s %10s\n", "query", "grid ns", "scan ns",
+         "speedup", "results");
+  for (int type = 0; type < QUERY_TYPES_COUNT; type++) {
+    long resultsCount = 0;
+    start = Now();
+    for (int i = 0; i < queriesCount; i++) {
+      resultsCount += Query(&grid, type, queries[2 * i], queries[2 * i + 1]);
+    }
+    double gridTime = (Now() - start) * 1e9 / queriesCount;
+    start = Now();
+    for (int i = 0; i < scansCount; i++) {
+      uint64_t checksum;
+      Scan(items, itemsCount, type, queries[2 * i], queries[2 * i + 1],
+           &checksum);
+    }
+    double scanTime = (Now() - start) * 1e9 / scansCount;
+    for (int i = 0; i < scansCount; i++) {
+      uint64_t expected;
+      float x = queries[2 * i], y = queries[2 * i + 1];
+      int expectedCount = Scan(items, itemsCount, type, x, y, &expected);
+      int count = Query(&grid, type, x, y);
+      if (count != expectedCount || GetChecksum(type, count) != expected) {
+        fprintf(stderr, "%s query %i: %i results instead of %i\n",
+                queryTypesName[type], i, count, expectedCount);
+        return 1;
+      }
+    }
+    printf("%12s %12.1f %12.1f %9.1fx %10.1f\n", queryTypesName[type],
+           gridTime, scanTime, scanTime / gridTime,
+           (double)resultsCount / queriesCount);
+  }
+
+  // Small steps, as units moving every tick
+  start = Now();
+  for (int i = 0; i < itemsCount; i++) {
+    SpatialItem *item = &items[i];
+    float x = item->x + (Random() - 0.5f) * 20.0f;
+    float y = item->y + (Random() - 0.5f) * 20.0f;
+    MoveSpatialItem(&grid, item->id, item->x, item->y, x, y);
+    item->x = x;
+    item->y = y;
+  }
+  printf("move: %.1f ns/item\n", (Now() - start) * 1e9 / itemsCount);
+
+  FreeSpatialGrid(&grid);
+  free(items);
+  free(queries);
+  return 0;
+}
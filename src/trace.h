@@ -0,0 +1,292 @@
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Begin/end events of named scopes, written as a Chrome trace-event JSON file
+// to open in chrome://tracing or ui.perfetto.dev.
+//
+// Recording is off unless TraceInit() finds WOP_TRACE in the environment: the
+// name of the file to write, or "1" for TRACE_DEFAULT_FILE_NAME. When off,
+// TRACE_BEGIN/TRACE_END only test a flag. Define TRACE_NO_EVENTS to compile
+// them out entirely.
+//
+// Every thread appends to its own buffer, created on its first event and
+// pushed on a global list with a compare and swap, so recording never takes
+// a lock. Only its thread writes a buffer, readers see the events published
+// by its count. A buffer is a ring: once full, new events overwrite the
+// oldest ones, so a trace written late in a session still shows its last
+// frames. WriteTrace copies the ring, then checks the count again to drop
+// what was overwritten during the copy. It marks where the kept events start
+// with an instant event, begins there the scopes whose begin was overwritten
+// and ends the scopes still running, so viewers nest every event right.
+//
+// Names must outlive the trace, string literals in practice.
+//
+// MSVC needs /std:c11 and /experimental:c11atomics, as set in the VS2022
+// project.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef TRACEDEF
+#define TRACEDEF // Functions defined as 'extern' by default (implicit
+                 // specifiers)
+#endif
+
+#define TRACE_DEFAULT_FILE_NAME "trace.json"
+#define TRACE_BUFFER_SIZE (1 << 18) // Events kept per thread, power of two
+
+typedef struct TraceEvent {
+  const char *name;
+  uint64_t time; // Nanoseconds since TraceInit
+  char phase;    // 'B' or 'E', as in the trace-event format
+} TraceEvent;
+
+typedef struct TraceBuffer {
+  TraceEvent *events;
+  _Atomic(uint64_t) count; // Events ever recorded, the last ones are kept
+  int threadId;
+  _Atomic(const char *) threadName;
+  struct TraceBuffer *next;
+} TraceBuffer;
+
+static bool traceIsEnabled = false;
+static const char *traceFileName = NULL;
+static uint64_t traceStartTime = 0;
+static _Atomic(TraceBuffer *) traceBuffers = NULL;
+static atomic_int traceThreadsCount = 0;
+static _Thread_local TraceBuffer *traceBuffer = NULL;
+
+#if defined(_WIN32)
+// Declared here as windows.h clashes with raylib names
+__declspec(dllimport) int __stdcall QueryPerformanceCounter(
+    unsigned long long int *performanceCount);
+__declspec(dllimport) int __stdcall QueryPerformanceFrequency(
+    unsigned long long int *frequency);
+#endif
+
+static uint64_t GetTraceTime(void) {
+#if defined(_WIN32)
+  unsigned long long int counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return counter / frequency * 1000000000u +
+         counter % frequency * 1000000000u / frequency;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+static TraceBuffer *GetTraceBuffer(void) {
+  if (traceBuffer)
+    return traceBuffer;
+  TraceBuffer *buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+  buffer->events =
+      (TraceEvent *)malloc(TRACE_BUFFER_SIZE * sizeof(TraceEvent));
+  buffer->threadId = atomic_fetch_add(&traceThreadsCount, 1);
+  TraceBuffer *next = atomic_load(&traceBuffers);
+  do {
+    buffer->next = next;
+  } while (!atomic_compare_exchange_weak(&traceBuffers, &next, buffer));
+  traceBuffer = buffer;
+  return buffer;
+}
+
+static void AddTraceEvent(const char *name, char phase) {
+  uint64_t time = GetTraceTime() - traceStartTime;
+  TraceBuffer *buffer = GetTraceBuffer();
+  uint64_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  buffer->events[count & (TRACE_BUFFER_SIZE - 1)] =
+      (TraceEvent){name, time, phase};
+  atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+// TRACE
+
+// Call first thing in main, before any other thread starts
+TRACEDEF void TraceInit(void) {
+  traceStartTime = GetTraceTime();
+  traceFileName = getenv("WOP_TRACE");
+  if (traceFileName && strcmp(traceFileName, "1") == 0)
+    traceFileName = TRACE_DEFAULT_FILE_NAME;
+  traceIsEnabled = traceFileName && traceFileName[0];
+}
+
+TRACEDEF void TraceBegin(const char *name) { AddTraceEvent(name, 'B'); }
+
+TRACEDEF void TraceEnd(const char *name) { AddTraceEvent(name, 'E'); }
+
+// Shown instead of "Thread <id>" in the viewers
+TRACEDEF void TraceSetThreadName(const char *name) {
+  if (traceIsEnabled)
+    atomic_store(&GetTraceBuffer()->threadName, name);
+}
+
+#if defined(TRACE_NO_EVENTS)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#else
+#define TRACE_BEGIN(name)                                                      \
+  do {                                                                         \
+    if (traceIsEnabled)                                                        \
+      TraceBegin(name);                                                        \
+  } while (0)
+#define TRACE_END(name)                                                        \
+  do {                                                                         \
+    if (traceIsEnabled)                                                        \
+      TraceEnd(name);                                                          \
+  } while (0)
+#endif
+
+static void WriteTraceString(FILE *file, const char *text) {
+  fputc('"', file);
+  for (const char *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      fputc('\\', file);
+    fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// name is NULL for the ends added by WriteTrace: viewers match ends by
+// thread and order
+static void WriteTraceEvent(FILE *file, bool *isFirst, const char *name,
+                            char phase, uint64_t time, int threadId) {
+  fputs(*isFirst ? "{" : ",\n{", file);
+  if (name) {
+    fputs("\"name\":", file);
+    WriteTraceString(file, name);
+    fputc(',', file);
+  }
+  fprintf(file, "\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", phase,
+          time / 1000.0, threadId);
+  *isFirst = false;
+}
+
+// Copies the events still in the ring to events, oldest first. Returns their
+// count and sets overwritten to the number of older events lost.
+static int CopyTraceEvents(TraceBuffer *buffer, TraceEvent *events,
+                           uint64_t *overwritten) {
+  uint64_t end = atomic_load_explicit(&buffer->count, memory_order_acquire);
+  uint64_t start = end > TRACE_BUFFER_SIZE ? end - TRACE_BUFFER_SIZE : 0;
+  for (uint64_t i = start; i < end; i++) {
+    events[i - start] = buffer->events[i & (TRACE_BUFFER_SIZE - 1)];
+  }
+  // Events the thread recorded meanwhile overwrote the oldest copied ones
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t after = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+  uint64_t validStart =
+      after > TRACE_BUFFER_SIZE ? after - TRACE_BUFFER_SIZE : 0;
+  if (validStart > start) {
+    if (validStart > end)
+      validStart = end;
+    memmove(events, events + (validStart - start),
+            (end - validStart) * sizeof(TraceEvent));
+    start = validStart;
+  }
+  *overwritten = start;
+  return (int)(end - start);
+}
+
+// Writes every event still in the buffers, threads may keep recording
+// meanwhile. Returns false when tracing is off or the file could not be
+// written.
+TRACEDEF bool WriteTrace(void) {
+  if (!traceIsEnabled)
+    return false;
+  FILE *file = fopen(traceFileName, "w");
+  if (!file)
+    return false;
+  TraceEvent *events =
+      (TraceEvent *)malloc(TRACE_BUFFER_SIZE * sizeof(TraceEvent));
+  // Ends whose begin was overwritten, innermost first
+  const char **orphanEnds =
+      (const char **)malloc(TRACE_BUFFER_SIZE * sizeof(const char *));
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+  bool isFirst = true;
+  for (TraceBuffer *buffer = atomic_load(&traceBuffers); buffer;
+       buffer = buffer->next) {
+    const char *threadName = atomic_load(&buffer->threadName);
+    if (threadName) {
+      fprintf(file,
+              "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%d,\"args\":{\"name\":",
+              isFirst ? "" : ",\n", buffer->threadId);
+      WriteTraceString(file, threadName);
+      fputs("}}", file);
+      isFirst = false;
+    }
+    uint64_t overwritten;
+    int count = CopyTraceEvents(buffer, events, &overwritten);
+    // Every copied event was recorded before
+    uint64_t endTime = GetTraceTime() - traceStartTime;
+    if (count == 0)
+      continue;
+    int depth = 0; // Scopes begun and not ended yet
+    int orphanEndsCount = 0;
+    for (int i = 0; i < count; i++) {
+      if (events[i].phase == 'B')
+        depth++;
+      else if (depth > 0)
+        depth--;
+      else
+        orphanEnds[orphanEndsCount++] = events[i].name;
+    }
+    if (overwritten > 0) {
+      fprintf(file,
+              "%s{\"name\":\"Trace buffer wrapped, %llu older events "
+              "overwritten\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+              "\"pid\":1,\"tid\":%d}",
+              isFirst ? "" : ",\n", (unsigned long long)overwritten,
+              events[0].time / 1000.0, buffer->threadId);
+      printf("Trace buffer of thread %d wrapped, %llu older events "
+             "overwritten\n",
+             buffer->threadId, (unsigned long long)overwritten);
+      isFirst = false;
+    }
+    // Outermost first
+    for (int i = orphanEndsCount - 1; i >= 0; i--) {
+      WriteTraceEvent(file, &isFirst, orphanEnds[i], 'B', events[0].time,
+                      buffer->threadId);
+    }
+    for (int i = 0; i < count; i++) {
+      WriteTraceEvent(file, &isFirst, events[i].name, events[i].phase,
+                      events[i].time, buffer->threadId);
+    }
+    for (; depth > 0; depth--) {
+      WriteTraceEvent(file, &isFirst, NULL, 'E', endTime, buffer->threadId);
+    }
+  }
+  free(events);
+  free(orphanEnds);
+  fputs("\n]}\n", file);
+  bool isWritten = !ferror(file);
+  isWritten = fclose(file) == 0 && isWritten;
+  if (isWritten)
+    printf("Trace written to %s\n", traceFileName);
+  return isWritten;
+}
+
+// Writes the trace and frees the buffers, once every other thread that
+// recorded events has stopped
+TRACEDEF void TraceShutdown(void) {
+  WriteTrace();
+  TraceBuffer *buffer = atomic_exchange(&traceBuffers, NULL);
+  while (buffer) {
+    TraceBuffer *next = buffer->next;
+    free(buffer->events);
+    free(buffer);
+    buffer = next;
+  }
+  traceBuffer = NULL;
+  traceIsEnabled = false;
+}
+
+#endif // TRACE_H
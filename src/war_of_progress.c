@@ -1,9 +1,26 @@
+#include "asset_pack.h"
+#include "binary_io.h"
+#include "instanced_sprites.h"
+#include "jobs.h"
+#include "lockfree.h"
 #include "perlin.h"
 #include "raylib.h"
+#include "rlgl.h"
+#include "spatial_grid.h"
+#include "trace.h"
+#include <math.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
 #define RAYGUI_IMPLEMENTATION
 #include "raygui.h"
 
@@ -11,20 +28,41 @@
 #include <emscripten/emscripten.h>
 #endif
 
+#if defined(PLATFORM_DESKTOP)
+// From the GLFW built in raylib, which does not ship its header
+int glfwExtensionSupported(const char *extension);
+#else
+// GLES 2, which still lists the extensions in one string
+const unsigned char *glGetString(unsigned int name);
+#define GL_EXTENSIONS 0x1F03
+#endif
+
 const int BASE_POPULATION_MAX = 5;
-const int SHELTER_POPULATION_NUMBER = 5;
+const int SHELTER_WOOD_COST = 50;
+const int CITY_HALL_WOOD_COST = 300;
+const int GATHER_TICKS = 30;     // Per unit harvested
+const int GATHER_CAPACITY = 10;  // Units carried back at once
+const float GATHER_RANGE = 16.0f; // From the hitbox of what is gathered
+const float COMBAT_ACQUIRE_RANGE = 1200.0f; // Around idle units, in pixels
+const float COMBAT_LEASH_RANGE = 2400.0f; // Farther targets are given up
+const int COMBAT_ACQUIRE_INTERVAL = 10;   // Ticks between two searches
+const float BATTLE_GAP = 3000.0f;         // Between the two armies
+const float BATTLE_SPACING = 20.0f;       // Between the units of an army
+const int SPAWN_ROWS = 3;          // Below a building, for the units it trains
+const int SPAWN_EXTRA_COLUMNS = 2; // On each side, past the building width
+const float SPAWN_SPACING = 4.0f;  // Between the units spawned
 
 static void InitTextures(void);
+static bool UpdateTexturesLoading(void);
+static void FinishTexturesLoading(void);
+static float GetTexturesLoadingProgress(void);
 static void FreeTextures(void);
-static void UpdateDrawFrame(RenderTexture2D);
+static void UpdateDrawFrame(void);
 static void RenderMenu(void);
 static void ProcessMovements(void);
-static void RenderMainGame(void);
 static void InitCamera(void);
 static void CheckScroll(Camera2D *);
 static void CheckMouseZoom(Camera2D *);
-static void CheckSelect(Camera2D *);
-static void CheckBuilding(Camera2D *);
 static void CheckMovement(Camera2D *);
 static void CheckInputs();
 static float ToXIso(int, int);
@@ -33,24 +71,57 @@ static float ToXInvertedIso(int, int);
 static float ToYInvertedIso(int, int);
 static void InitGame(void);
 static void FreeGame(void);
+static void FreeEntities(void);
+static void FreeMap(void);
+static void ProcessGathering(void);
+static void ProcessProduction(void);
+static void ProcessVision(void);
+static void ProcessCombat(void);
+static void RemoveFromEntities(int);
+static void UpdateWorldGeneration(void);
 static void DrawHelpWindow(int, int);
-static void DrawTopHud(void);
 static int GetPopulation(void);
 static int GetMaxPopulation(void);
 
 typedef enum EntityType {
   // Units
   VILLAGER,
+  SOLDIER,
+  ARCHER,
 
   // Buildings
   CITY_HALL,
   SHELTER,
 
   // Resources
-  TREE
+  TREE,
+
+  ENTITY_TYPES_COUNT
 } EntityType;
 
+// Entities that belong to nobody, as trees, are the player's: masks of types
+// alone are those of the player's entities, see GetTeamMask
+typedef enum Team { TEAM_PLAYER, TEAM_ENEMY, TEAMS_COUNT } Team;
+
 static bool TryBuild(EntityType, Vector2);
+static void ReserveEntities(int);
+static void AddToEntities(EntityType, Vector2, Team);
+static void FreeSelectedEntities(void);
+
+typedef enum ResourceType {
+  RESOURCE_NONE,
+  RESOURCE_WOOD,
+  RESOURCE_STONE,
+  RESOURCE_GOLD,
+  RESOURCE_FOOD
+} ResourceType;
+
+struct Resources {
+  int wood;
+  int stone;
+  int gold;
+  int food;
+};
 
 typedef struct GameTexture {
   Texture2D texture;
@@ -62,82 +133,271 @@ static float GetGameTextureWidth(GameTexture *gameTexture) {
   return (float)gameTexture->texture.width / gameTexture->animFramesNumber;
 }
 
+// What every entity of a type shares, see archetypes
+typedef struct Archetype {
+  GameTexture *texture; // Of the first age, the only one so far
+  Rectangle relativeHitbox;
+  int hp;
+  int moveSpeed;
+  bool isControllable;
+  bool canGather;
+  ResourceType resource;   // Gathered from it, its hp is what is left
+  bool isDropOff;          // Gatherers bring their resources back to it
+  int populationCapacity;  // Added to the maximum population
+  unsigned int trainsMask; // Types of the units it trains
+  struct Resources cost;   // To train it
+  int trainTicks;
+  int sightRadius; // In tiles, at most SIGHT_RADIUS_MAX, 0 sees nothing
+  int attackDamage;  // 0 cannot attack
+  float attackRange; // Between the hitboxes
+  int attackTicks;   // Between two attacks
+  float frameDuration; // Seconds every animation frame stays on screen
+  // From the texture, once loaded
+  int framesCount;
+  float frameWidth;
+  float frameHeight;
+} Archetype;
+
+// Entities only keep their own state, the rest is looked up by type
 typedef struct Entity {
   Vector2 position;
-  Rectangle relativeHitbox;
   EntityType type;
+  Team team;
   int hp;
-  int animCurrentFrame;
+  float animPhase; // Part of its animation loop it is ahead of the clock
   bool isSelected;
   Vector2 targetPosition;
-  bool isControllable;
-  int moveSpeed;
+  int id; // Stays the same when the entity moves in entities
+  // Where the systems keep it, -1 when they do not
+  int gatherer;
+  int productionQueue;
+  int viewer;
+  int combatant;
 } Entity;
 
+// Where the entity with id is, see ENTITY IDS
+typedef struct EntityIdSlot {
+  int id;    // Current one, the slot plus the generation
+  int index; // Of the entity, or of the next free slot
+} EntityIdSlot;
+
 static Rectangle GetEntityHitbox(Entity *entity);
 static bool CanMove(Vector2, Entity *);
+static void MoveInEntitiesGrid(int, Vector2);
+static int QueryEntitiesAround(Rectangle, unsigned int, SpatialItem *, int);
+static SpatialCursor StartEntitiesAround(Rectangle, unsigned int);
 
-Entity createCityHallEntity(Vector2 position) {
-  return (Entity){.position = position,
-                  .relativeHitbox = {103.0, 212.0, 655.0, 480.0},
-                  .type = CITY_HALL,
-                  .hp = 3000,
-                  .animCurrentFrame = 1,
-                  .isSelected = false,
-                  .targetPosition = position,
-                  .isControllable = false};
-}
+typedef enum GatherState {
+  GATHER_GOING,
+  GATHER_HARVESTING,
+  GATHER_RETURNING
+} GatherState;
 
-Entity createTreeEntity(Vector2 position) {
-  return (Entity){.position = position,
-                  .relativeHitbox = {213.0, 44.0, 80.0, 400.0},
-                  .type = TREE,
-                  .hp = 400,
-                  .animCurrentFrame = 1,
-                  .isSelected = false,
-                  .targetPosition = position,
-                  .isControllable = false};
-}
+// Villager sent to gather a resource, see GATHERING
+typedef struct Gatherer {
+  int entity;
+  int resourceId; // -1 to look for the nearest one
+  int dropOffId;  // -1 to look for the nearest one
+  ResourceType resource;
+  GatherState state;
+  int carried;
+  int harvestTicks; // Left before the next unit
+} Gatherer;
 
-Entity createShelterEntity(Vector2 position) {
-  return (Entity){.position = position,
-                  .relativeHitbox = {100.0, 230.0, 430.0, 226.0},
-                  .type = SHELTER,
-                  .hp = 500,
-                  .animCurrentFrame = 1,
-                  .isSelected = false,
-                  .targetPosition = position,
-                  .isControllable = false};
-}
+#define PRODUCTION_QUEUE_SIZE 5
 
-Entity createVillagerEntity(Vector2 position) {
-  return (Entity){.position = position,
-                  .relativeHitbox = {53.0, 9.0, 20.0, 112.0},
-                  .type = VILLAGER,
-                  .hp = 100,
-                  .animCurrentFrame = 1,
-                  .isSelected = false,
-                  .targetPosition = position,
-                  .isControllable = true,
-                  .moveSpeed = 5};
-}
+// Units a building trains one after the other, a ring buffer
+typedef struct ProductionQueue {
+  int building;
+  int ticksLeft; // Before the first unit is trained
+  int first;
+  int count;
+  EntityType units[PRODUCTION_QUEUE_SIZE];
+} ProductionQueue;
 
-struct Resources {
-  int wood;
-  int stone;
-  int gold;
-  int food;
-};
+// An entity that reveals the tiles around it
+typedef struct Viewer {
+  int entity;
+  int tileX; // Where it was seen from last
+  int tileY;
+  int radius;
+} Viewer;
+
+// An entity that can attack
+typedef struct Combatant {
+  int entity;
+  int targetId; // -1 when it has none
+  int cooldown; // Ticks before it can attack again
+  bool isAttackMoving; // Attacks what it meets on its way to destination
+  Vector2 destination;
+} Combatant;
+
+// Dealt to target, -1 for none
+typedef struct Damage {
+  int target;
+  int amount;
+} Damage;
+
+typedef enum Fog { FOG_NONE, FOG_EXPLORED, FOG_UNEXPLORED } Fog;
+
+static Fog GetTileFog(uint64_t *, uint64_t *, int);
+
+// What the renderer and the input need to know about an entity. Copied from
+// the simulation every tick so drawing never reads entities being updated.
+typedef struct EntitySnapshot {
+  int id; // Commands name entities by id, their index may change meanwhile
+  Vector2 position;
+  Rectangle hitbox;
+  EntityType type;
+  Team team;
+  float animPhase;
+  bool isSelected;
+  Fog fog;        // Of its tile
+  bool isVisible; // Written by the renderer culling
+} EntitySnapshot;
+
+typedef struct RenderSnapshot {
+  EntitySnapshot *entities;
+  int entitiesSize;
+  int entitiesCapacity;
+  struct Resources resources;
+  int population;
+  int maxPopulation;
+  int queuedPopulation;
+  unsigned int tick;
+  uint64_t stateHash;
+  // Copied only when visionVersion changed
+  uint64_t *visibleTiles;
+  uint64_t *exploredTiles;
+  int tilesWordsCount;
+  unsigned int visionVersion;
+  // Entities moved or added since a snapshot the renderer read, may repeat
+  // some it already saw. When changes were lost, everything may have changed.
+  int *changedEntities;
+  int changedEntitiesSize;
+  int changedEntitiesCapacity;
+  unsigned int changesEnd; // Sequence number after the last change
+  bool hasLostChanges;
+  unsigned int selectionVersion; // Changes when the selection does
+} RenderSnapshot;
+
+typedef enum CommandType {
+  COMMAND_SELECT,
+  COMMAND_MOVE,
+  COMMAND_BUILD
+} CommandType;
+
+// Player order sent by the input to the simulation
+typedef struct Command {
+  CommandType type;
+  int entityId;          // COMMAND_SELECT, -1 clears the selection
+  EntityType entityType; // COMMAND_BUILD
+  Vector2 position;      // COMMAND_MOVE target, COMMAND_BUILD position
+} Command;
+
+// Everything the world image depends on besides the animations
+typedef struct WorldView {
+  Camera2D camera;
+  int targetWidth;
+  int targetHeight;
+  unsigned int changesEnd;
+  unsigned int selectionVersion;
+  GameTexture *atCursorTexture;
+  Vector2 cursorPosition; // Only when a texture follows the cursor
+  bool showHitboxes;
+} WorldView;
+
+// Everything the HUD depends on, besides the FPS counter
+typedef struct HudView {
+  struct Resources resources;
+  int population;
+  int maxPopulation;
+  int queuedPopulation;
+  int screenWidth;
+  int screenHeight;
+  bool showHelp;
+} HudView;
+
+static void RenderMainGame(RenderSnapshot *);
+static void CheckSelect(Camera2D *, RenderSnapshot *);
+static void CheckBuilding(Camera2D *, RenderSnapshot *);
+static void DrawTopHud(RenderSnapshot *, int);
+static void DrawDebugOverlay(RenderSnapshot *);
+static void RenderHud(RenderSnapshot *);
+static void UpdateHud(RenderSnapshot *);
+static void DrawHudTexture(RenderTexture2D, float, float);
+static void FreeHud(void);
+static void RecordEntityChange(int);
+static bool CheckMinimap(Camera2D *);
+static void UpdateMinimap(RenderSnapshot *);
+static void DrawMinimap(void);
+static void FreeMinimap(void);
+static void UpdateRenderTarget(void);
+static void UpdateDynamicResolution(double, double);
+static bool ShouldRenderWorld(RenderSnapshot *);
+static HudView GetHudView(RenderSnapshot *);
+static void UpdateIdleRefresh(RenderSnapshot *, bool);
+static bool CanAffordBuild(EntityType, struct Resources *);
+static void StartGame(void);
+static void StartSimulation(void);
+static void StopSimulation(void);
+static void SimulationTick(void);
+static double GetMonotonicTime(void);
+static uint64_t GetSimulationStateHash(void);
+static uint64_t ComputeSimulationStateHash(void);
+static void UpdateEntityHash(int);
+static uint64_t HashEntity(Entity *, int);
+static void LogStateHash(void);
+static void BeginCommandLog(void);
+static void LogCommand(Command *);
+static void EndCommandLog(const char *);
+static bool LoadCommandLog(const char *);
+static void ReplayCommands(void);
+static void RunFastReplay(int, int);
 
 enum Scene { MENU, MAIN_GAME };
 enum Scene current_scene = MENU;
-enum Tile { GRASS };
+enum Tile { GRASS, TILES_COUNT };
 
-static GameTexture TileToTexture(enum Tile);
-static GameTexture EntityToTexture(enum EntityType);
+static uint64_t HashMap(enum Tile **, Vector2);
 
 #define MAP_WIDTH 200
+#define MENU_MAP_WIDTHS_COUNT 3
 #define GAME_FONT_SIZE 20
+#define SIMULATION_TICK_RATE 60
+#define TARGET_FPS 60
+#define IDLE_FRAMES_BEFORE_LOW_REFRESH 60
+#define HUD_FPS_UPDATE_RATE 4
+#define FRAME_TIME_BUDGET (1.0 / 60.0)
+#define RENDER_SCALE_MIN 0.5f
+#define RENDER_SCALE_STEP 0.1f
+#define TERRAIN_LOD_LEVELS 2
+#define TERRAIN_IMPOSTOR_WIDTH 2048
+#define MAX_PENDING_CHANGES 65536
+#define ENTITIES_GRID_CELL_SIZE 1024.0f
+#define NEARBY_ENTITIES_MAX 256 // Spatial query results kept on the stack
+#define ENTITY_ID_SLOT_MASK 0x3FFFFF // Up to 4M entities, the generation above
+#define ENTITY_ID_MASK 0x7FFFFFFF     // Ids stay positive
+#define ALL_ENTITY_TYPES_MASK ((1u << ENTITY_TYPES_COUNT * TEAMS_COUNT) - 1)
+#define SIGHT_RADIUS_MAX 16
+#define MINIMAP_DISPLAY_WIDTH 240 // Drawn as a diamond half as high
+#define MINIMAP_LAYERS 3
+#define MINIMAP_MAX_TEXEL_UPLOADS 64
+#define COMMANDS_QUEUE_SIZE 256 // Power of two
+#define COMMAND_LOG_MAGIC "WOPL"
+#define COMMAND_LOG_VERSION 4
+#define COMMAND_LOG_HASH 0xFE
+#define COMMAND_LOG_END 0xFF
+#define STATE_HASH_LOG_INTERVAL 60 // Ticks between two logged state hashes
+#define LAST_SESSION_LOG_PATH "last_session.wopl"
+#define ASSET_PACK_PATH "assets.pack"
+#define ASSET_PACK_TEXTURE_SIZE_MAX 16384 // Larger pack entries are rejected
+#define WORLD_CACHE_PATH "world_cache"
+#define WORLD_CACHE_MAGIC "WOPW"
+#define WORLD_CACHE_VERSION 2 // Of the file format
+// Bump when the generator code changes, cached worlds are then regenerated.
+// Its parameters, the noise and the tile size are checked automatically.
+#define WORLD_GENERATOR_VERSION 2
 
 static Camera2D camera = {0};
 static GameTexture grassTexture;
@@ -145,228 +405,956 @@ static GameTexture primitiveCityHallTexture;
 static GameTexture primitiveShelterTexture;
 static GameTexture primitiveVillagerTexture;
 static GameTexture treeTexture;
+static int texturesLoadedCount = 0;
+static AssetPack assetPack = {0}; // Open while textures are loading
+// GPU memory used by the loaded textures, and what it would be as RGBA8
+static int texturesMemorySize = 0;
+static int texturesRgbaMemorySize = 0;
+static bool isDxtSupported = false; // Checked once the window exists
+static Archetype archetypes[ENTITY_TYPES_COUNT] = {
+    [VILLAGER] = {.texture = &primitiveVillagerTexture,
+                  .relativeHitbox = {53.0, 9.0, 20.0, 112.0},
+                  .hp = 100,
+                  .moveSpeed = 5,
+                  .isControllable = true,
+                  .canGather = true,
+                  .cost = {.food = 50},
+                  .trainTicks = 10 * SIMULATION_TICK_RATE,
+                  .sightRadius = 6,
+                  .frameDuration = 0.1f},
+    [SOLDIER] = {.texture = &primitiveVillagerTexture,
+                 .relativeHitbox = {53.0, 9.0, 20.0, 112.0},
+                 .hp = 150,
+                 .moveSpeed = 4,
+                 .isControllable = true,
+                 .cost = {.wood = 20, .food = 60},
+                 .trainTicks = 12 * SIMULATION_TICK_RATE,
+                 .sightRadius = 6,
+                 .attackDamage = 12,
+                 .attackRange = 10.0f,
+                 .attackTicks = SIMULATION_TICK_RATE,
+                 .frameDuration = 0.1f},
+    [ARCHER] = {.texture = &primitiveVillagerTexture,
+                .relativeHitbox = {53.0, 9.0, 20.0, 112.0},
+                .hp = 80,
+                .moveSpeed = 5,
+                .isControllable = true,
+                .cost = {.wood = 40, .food = 30},
+                .trainTicks = 12 * SIMULATION_TICK_RATE,
+                .sightRadius = 8,
+                .attackDamage = 6,
+                .attackRange = 700.0f,
+                .attackTicks = 3 * SIMULATION_TICK_RATE / 2,
+                .frameDuration = 0.1f},
+    [CITY_HALL] = {.texture = &primitiveCityHallTexture,
+                   .relativeHitbox = {103.0, 212.0, 655.0, 480.0},
+                   .hp = 3000,
+                   .isDropOff = true,
+                   .trainsMask = 1u << VILLAGER | 1u << SOLDIER | 1u << ARCHER,
+                   .sightRadius = 10,
+                   .frameDuration = 0.15f},
+    [SHELTER] = {.texture = &primitiveShelterTexture,
+                 .relativeHitbox = {100.0, 230.0, 430.0, 226.0},
+                 .hp = 500,
+                 .populationCapacity = 5,
+                 .sightRadius = 4,
+                 .frameDuration = 0.15f},
+    [TREE] = {.texture = &treeTexture,
+              .relativeHitbox = {213.0, 44.0, 80.0, 400.0},
+              .hp = 400,
+              .resource = RESOURCE_WOOD,
+              .frameDuration = 0.2f}};
+static GameTexture *tileTextures[TILES_COUNT] = {[GRASS] = &grassTexture};
 static Vector2 mapSize = {MAP_WIDTH, MAP_WIDTH};
+static const int menuMapWidths[MENU_MAP_WIDTHS_COUNT] = {
+    MAP_WIDTH / 2, MAP_WIDTH, MAP_WIDTH * 3 / 2};
 static enum Tile **map = NULL;
 static Entity *entities = NULL;
 static int entitiesSize = 0;
 static int entitiesCapacity = 20;
+// Per-entity scratch buffer for the parallel movements, sized as entities
+static Vector2 *entitiesNextPosition = NULL;
+// Index of the entity of every id, see ENTITY IDS
+static EntityIdSlot *entityIdSlots = NULL;
+static int entityIdSlotsSize = 0;
+static int entityIdSlotsCapacity = 0;
+static int freeEntityIdSlot = -1; // First of the free ones, chained by index
 static struct Resources resources;
+// Every entity by its ground point, see SPATIAL QUERIES
+static SpatialGrid entitiesGrid = {0};
+static Vector2 entitiesReach = {0};
+static Gatherer *gatherers = NULL;
+static int gatherersSize = 0;
+static int gatherersCapacity = 0;
+// Every entity that can attack, see COMBAT. The damages of the tick and the
+// entities they kill are sized as combatants.
+static Combatant *combatants = NULL;
+static int combatantsSize = 0;
+static int combatantsCapacity = 0;
+static Damage *damages = NULL;
+static int *deadEntities = NULL;
+// Units per team of the --battle scenario, 0 for a normal game
+static int battleSize = 0;
+// Only the buildings training units have a queue, see PRODUCTION
+static ProductionQueue *productionQueues = NULL;
+static int productionQueuesSize = 0;
+static int productionQueuesCapacity = 0;
+// Updated as entities are added and removed, see CountPopulation
+static int population = 0;
+static int maxPopulation = 0;
+static int queuedPopulation = 0; // Units paid for in the production queues
+// Fog of war, see VISION. Tile i, j is bit j * mapSize.x + i.
+static unsigned short *visionCounts = NULL; // Viewers that see every tile
+static uint64_t *visibleTiles = NULL;
+static uint64_t *exploredTiles = NULL;
+static int tilesWordsCount = 0;
+static unsigned int visionVersion = 0; // Changes when the bits do
+static Viewer *viewers = NULL;
+static int viewersSize = 0;
+static int viewersCapacity = 0;
+// Half widths of the rows of the sight circles, by radius then row offset
+static int sightSpans[SIGHT_RADIUS_MAX + 1][SIGHT_RADIUS_MAX + 1];
+// Sum of the entities hashes, updated when one of them changes
+static uint64_t *entitiesHash = NULL;
+static uint64_t entitiesHashSum = 0;
+static uint64_t mapHash = 0;
+// Entities changed since the last snapshot the renderer is known to have
+// read, for the minimap. pendingChangesStart numbers the first one.
+static int *pendingChanges = NULL;
+static int pendingChangesSize = 0;
+static int pendingChangesCapacity = 0;
+static unsigned int pendingChangesStart = 0;
+static bool hasLostChanges = false;
+static unsigned int selectionVersion = 0;
+// Simulation to renderer handoff, renderer to simulation commands
+static RenderSnapshot renderSnapshots[3] = {0};
+static TripleBuffer renderSnapshotsBuffer;
+static SpscQueue commandsQueue;
+#if !defined(JOBS_NO_THREADS)
+static pthread_t simulationThread;
+static atomic_bool isSimulationRunning = false;
+static bool useSimulationThread = true;
+#else
+static bool useSimulationThread = false;
+#endif
+// Simulation ticks run per drawn frame when there is no simulation thread
+static int ticksPerFrame = 1;
+// No window nor GPU, only the simulation runs
+static bool isHeadless = false;
+static int worldSeed = 0;
+static bool isWorldSeedFixed = false; // By --seed or a replay, see WORLD CACHE
+static unsigned int simulationTick = 0;
+// Commands of the running session, saved when the simulation stops
+static ByteWriter commandLog = {0};
+static unsigned int commandLogLastTick = 0;
+// Session being replayed instead of the player commands
+static bool isReplaying = false;
+static bool isReplayDone = false;
+static unsigned char *replayData = NULL;
+static ByteReader replayReader = {0};
+static unsigned int replayNextTick = 0;
+static bool hasReplayDiverged = false;
+
+typedef enum SimulationSystem {
+  SYSTEM_COMMANDS,
+  SYSTEM_GATHERING,
+  SYSTEM_PRODUCTION,
+  SYSTEM_COMBAT,
+  SYSTEM_MOVEMENTS,
+  SYSTEM_VISION,
+  SYSTEM_SNAPSHOT,
+  SYSTEMS_COUNT
+} SimulationSystem;
+
+static const char *simulationSystemsName[SYSTEMS_COUNT] = {
+    "commands", "gathering", "production", "combat", "movements", "vision",
+    "snapshot"};
+// Seconds spent in every system since the simulation started
+static double simulationSystemsTime[SYSTEMS_COUNT] = {0};
 static bool toggleHelp = false;
 static GameTexture *atCursorTexture = NULL;
 static bool toggleHitboxes = false;
+static bool toggleDebugOverlay = false;
+static bool useInstancedSprites = false;
+static InstancedSprites treesSprites = {0};
+// The world is drawn at renderScale of the framebuffer size, then upscaled
+static RenderTexture2D renderTarget = {0};
+static float renderScale = 1.0f;
+static double averageFrameTime = FRAME_TIME_BUDGET;
+static double averageCpuTime = 0.0;
+static int renderScaleCooldown = 0;
+static int framesWithinBudget = 0;
+static int framesBeforeRaise = 2 * 60;
+static int framesSinceRaise = -1; // -1 once the last raise held
+// renderTarget is presented again while its world view did not change
+static WorldView renderedWorldView;
+static bool isWorldViewStale = true;
+static double worldAnimationsEnd = 0.0; // When a drawn frame gets replaced
+static HudView presentedHudView;
+static int idleFrames = 0;
+static int idleFps = 0; // Frame rate once idle, 0 keeps TARGET_FPS
+static bool isIdleRefresh = false;
+// HUD parts rendered only when the view they were rendered from changes
+static RenderTexture2D topHudTexture = {0};
+static HudView topHudView;
+static int topHudFps = -1;
+static RenderTexture2D helpTexture = {0};
+static int hudFps = 0; // Sampled at HUD_FPS_UPDATE_RATE
+static double hudFpsTime = 0.0;
+// Zoomed out terrain: blocks of tiles of the same type are drawn as one
+// pre-reduced impostor, coarser blocks at lower zooms
+static const int terrainBlockSizes[TERRAIN_LOD_LEVELS] = {4, 16};
+static RenderTexture2D terrainImpostors[TERRAIN_LOD_LEVELS][TILES_COUNT];
+// Tile type of every block, -1 when it mixes types or is cut by the map edge
+static int *terrainBlocks[TERRAIN_LOD_LEVELS] = {NULL};
+static bool areTerrainImpostorsLoaded = false;
+// One texel per tile, updated from the snapshots changes only
+static Image minimapImage = {0};
+static Texture2D minimapTexture = {0};
+static bool isMinimapStale = true;
+static unsigned int minimapTick = 0;
+// Entities of each layer in every texel, the top non empty layer is shown
+static unsigned short *minimapCounts = NULL;
+// Texel where each entity is counted, -1 when it is in none
+static int *minimapEntityTexels = NULL;
+static int minimapEntityTexelsCapacity = 0;
+static int *minimapDirtyTexels = NULL;
+static int minimapDirtyTexelsSize = 0;
+// Bounding box of the dirty texels when uploaded at once, sized as the minimap
+static Color *minimapUploadBox = NULL;
+// Fog shown, the bits of the snapshot of minimapVisionVersion
+static uint64_t *minimapVisibleTiles = NULL;
+static uint64_t *minimapExploredTiles = NULL;
+static unsigned int minimapVisionVersion = 0;
 
-static int GetPopulation() {
-  int population = 0;
-  for (int i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    if (entity->isControllable)
-      population++;
-  }
-  return population;
+static int GetPopulation() { return population; }
+
+static int GetMaxPopulation() { return maxPopulation; }
+
+// The entity was added, count 1, or is removed, count -1
+static void CountPopulation(Entity *entity, int count) {
+  if (entity->team != TEAM_PLAYER)
+    return;
+  Archetype *archetype = &archetypes[entity->type];
+  if (archetype->isControllable)
+    population += count;
+  maxPopulation += count * archetype->populationCapacity;
 }
 
-static int GetMaxPopulation() {
-  int maxPopulation = BASE_POPULATION_MAX;
+// Once for the entities of a new world, then kept by CountPopulation
+static void InitPopulation(void) {
+  population = 0;
+  maxPopulation = BASE_POPULATION_MAX;
+  queuedPopulation = 0;
   for (int i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    if (entity->type == SHELTER)
-      maxPopulation += SHELTER_POPULATION_NUMBER;
+    CountPopulation(&entities[i], 1);
   }
-  return maxPopulation;
 }
 
-int main() {
-  SetConfigFlags(FLAG_WINDOW_HIGHDPI);
-  InitWindow(0, 0, "War of progress");
-  GuiLoadStyleDefault();
+// Usage: war_of_progress [--idle-fps <fps>] [--seed <seed>] [--battle <units>]
+//                        [--replay <file> [--fast [--render-every <ticks>]
+//                        [--hash-every <ticks>]]]
+// --idle-fps lowers the frame rate while nothing changes on screen.
+// --seed generates the same world every game instead of a random one.
+// --battle starts games with <units> units per team around the city hall,
+// the enemies attacking (see SpawnBattle).
+// --fast runs the replay as fast as possible and prints timings at the end.
+// It draws one frame every <ticks> ticks, or opens no window by default.
+// --hash-every prints the state hash every <ticks> ticks, to diff two runs.
+// WOP_TRACE=<file> records a trace of the startup and of every frame, written
+// on exit or with F4 (see trace.h).
+int main(int argc, char **argv) {
+  TraceInit();
+  TraceSetThreadName("main");
+  const char *replayFileName = NULL;
+  bool isFastReplay = false;
+  int renderInterval = 0;
+  int hashInterval = 0;
+  const char *seedArgument = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+      replayFileName = argv[++i];
+    else if (strcmp(argv[i], "--fast") == 0)
+      isFastReplay = true;
+    else if (strcmp(argv[i], "--render-every") == 0 && i + 1 < argc)
+      renderInterval = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--hash-every") == 0 && i + 1 < argc)
+      hashInterval = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--idle-fps") == 0 && i + 1 < argc)
+      idleFps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      seedArgument = argv[++i];
+    else if (strcmp(argv[i], "--battle") == 0 && i + 1 < argc)
+      battleSize = atoi(argv[++i]);
+  }
+  isHeadless = replayFileName && isFastReplay && renderInterval <= 0;
+
+  if (!isHeadless) {
+    TRACE_BEGIN("InitWindow");
+    SetConfigFlags(FLAG_WINDOW_HIGHDPI);
+    InitWindow(0, 0, "War of progress");
+    GuiLoadStyleDefault();
+    TRACE_END("InitWindow");
+  }
+  TRACE_BEGIN("JobsInit");
+  JobsInit(-1);
+  TRACE_END("JobsInit");
+  TRACE_BEGIN("InitTextures");
   InitTextures();
+  TRACE_END("InitTextures");
+
+  if (isFastReplay && replayFileName) {
+    if (LoadCommandLog(replayFileName))
+      RunFastReplay(renderInterval, hashInterval);
+    StopSimulation();
+    FreeGame();
+    if (!isHeadless) {
+      UnloadRenderTexture(renderTarget);
+      FreeTextures();
+      CloseWindow();
+    }
+    JobsShutdown();
+    TraceShutdown();
+    return isReplayDone && !hasReplayDiverged ? 0 : 1;
+  }
 
-  RenderTexture2D target =
-      LoadRenderTexture(GetScreenWidth(), GetScreenHeight());
+  if (replayFileName && LoadCommandLog(replayFileName)) {
+    StartGame();
+  }
+
+  UpdateRenderTarget();
+  if (current_scene == MENU) {
+    worldSeed = seedArgument ? atoi(seedArgument) : (int)time(NULL);
+    isWorldSeedFixed = seedArgument != NULL;
+    TRACE_BEGIN("Menu"); // Until the game starts
+  }
 
 #if defined(PLATFORM_WEB)
-  emscripten_set_main_loop(UpdateDrawFrame, 60, 1);
+  emscripten_set_main_loop(UpdateDrawFrame, TARGET_FPS, 1);
 #else
-  SetTargetFPS(60);
+  SetTargetFPS(TARGET_FPS);
 
   while (!WindowShouldClose()) {
-    UpdateDrawFrame(target);
+    UpdateDrawFrame();
   }
 #endif
+  StopSimulation();
+  UnloadRenderTexture(renderTarget);
   FreeGame();
   FreeTextures();
+  JobsShutdown();
   CloseWindow();
+  TraceShutdown();
   return 0;
 }
 
-static void UpdateDrawFrame(RenderTexture2D target) {
-  BeginTextureMode(target);
+static void UpdateDrawFrame(void) {
+  TRACE_BEGIN("Frame");
+  double frameStart = GetMonotonicTime();
+  RenderSnapshot *snapshot = NULL;
+  bool isWorldRendered = false;
+  bool wasIdleRefresh = isIdleRefresh;
+  UpdateTexturesLoading();
+  UpdateWorldGeneration();
+  if (current_scene == MAIN_GAME) {
+    if (!useSimulationThread) {
+      for (int i = 0; i < ticksPerFrame; i++) {
+        SimulationTick();
+      }
+    }
+    snapshot = &renderSnapshots[TripleBufferAcquire(&renderSnapshotsBuffer)];
+    TRACE_BEGIN("Inputs");
+    CheckScroll(&camera);
+    CheckMouseZoom(&camera);
+    if (!CheckMinimap(&camera)) {
+      CheckSelect(&camera, snapshot);
+      CheckMovement(&camera);
+      CheckBuilding(&camera, snapshot);
+    }
+    CheckInputs();
+    TRACE_END("Inputs");
+    TRACE_BEGIN("UpdateMinimap");
+    UpdateMinimap(snapshot);
+    TRACE_END("UpdateMinimap");
+    UpdateRenderTarget();
+    isWorldRendered = ShouldRenderWorld(snapshot);
+    if (isWorldRendered) {
+      TRACE_BEGIN("RenderMainGame");
+      BeginTextureMode(renderTarget);
+      RenderMainGame(snapshot);
+      EndTextureMode();
+      TRACE_END("RenderMainGame");
+    }
+    TRACE_BEGIN("UpdateHud");
+    UpdateHud(snapshot);
+    TRACE_END("UpdateHud");
+  }
 
+  TRACE_BEGIN("Draw");
+  BeginDrawing();
   switch (current_scene) {
   case MENU:
     RenderMenu();
     break;
   case MAIN_GAME:
-    CheckScroll(&camera);
-    CheckMouseZoom(&camera);
-    CheckSelect(&camera);
-    CheckMovement(&camera);
-    CheckBuilding(&camera);
-    CheckInputs();
-    ProcessMovements();
-    RenderMainGame();
+    // Filtered upscale of the world, the HUD is drawn at native resolution
+    DrawTexturePro(renderTarget.texture,
+                   (Rectangle){0, 0, (float)renderTarget.texture.width,
+                               (float)-renderTarget.texture.height},
+                   (Rectangle){0, 0, GetScreenWidth(), GetScreenHeight()},
+                   (Vector2){0, 0}, 0.0f, WHITE);
+    RenderHud(snapshot);
+    UpdateIdleRefresh(snapshot, isWorldRendered);
     break;
   }
-
-  EndTextureMode();
-
-  BeginDrawing();
-  DrawTextureRec(target.texture,
-                 (Rectangle){0, 0, (float)target.texture.width,
-                             (float)-target.texture.height},
-                 (Vector2){0, 0}, WHITE);
+  double cpuTime = GetMonotonicTime() - frameStart;
+  TRACE_END("Draw");
+  // Includes the wait for the target frame rate
+  TRACE_BEGIN("EndDrawing");
   EndDrawing();
+  TRACE_END("EndDrawing");
+  // Presented again or idle frames say nothing about the rendering cost
+  if (isWorldRendered && !wasIdleRefresh)
+    UpdateDynamicResolution(cpuTime, GetFrameTime());
+  TRACE_END("Frame");
 }
 
 // SCENES
 
 static void RenderMenu(void) {
   ClearBackground(BLACK);
+  float progress = GetTexturesLoadingProgress();
+  if (progress < 1.0f) {
+    GuiProgressBar((Rectangle){24, 24, 120, 30}, NULL, "Loading", &progress,
+                   0.0f, 1.0f);
+    return;
+  }
+  // Changing the map size generates the world again in the background
+  int mapWidthIndex = 0;
+  while (mapWidthIndex < MENU_MAP_WIDTHS_COUNT - 1 &&
+         menuMapWidths[mapWidthIndex] != mapSize.x)
+    mapWidthIndex++;
+  GuiToggleGroup((Rectangle){24, 64, 80, 30}, "Small;Normal;Large",
+                 &mapWidthIndex);
+  mapSize = (Vector2){menuMapWidths[mapWidthIndex],
+                      menuMapWidths[mapWidthIndex]};
   if (GuiButton((Rectangle){24, 24, 120, 30}, "Start game")) {
-    InitCamera();
-    InitGame();
-    current_scene = MAIN_GAME;
+    TRACE_END("Menu");
+    StartGame();
   }
 }
 
-static void ProcessMovements(void) {
-  for (int i = 0; i < entitiesSize; i++) {
+static void StartGame(void) {
+  TRACE_BEGIN("StartGame");
+  FinishTexturesLoading();
+  isMinimapStale = true;
+  isWorldViewStale = true;
+  InitGame();
+  InitCamera();
+  StartSimulation();
+  current_scene = MAIN_GAME;
+  TRACE_END("StartGame");
+}
+
+const int MOVEMENTS_GRAIN_SIZE = 256;
+
+// Next positions are computed from the current ones only, so entities can be
+// moved in parallel and the result does not depend on the threads count.
+static void ComputeNextPositions(void *data, int start, int end) {
+  for (int i = start; i < end; i++) {
     Entity *entity = &entities[i];
+    Vector2 position = entity->position;
+    entitiesNextPosition[i] = position;
+    if (position.x == entity->targetPosition.x &&
+        position.y == entity->targetPosition.y)
+      continue;
     Rectangle entityHitbox = GetEntityHitbox(entity);
-    int deltaMovement = GetFrameTime() * GetFPS() * entity->moveSpeed;
-    if (entity->position.x < entity->targetPosition.x) {
+    int deltaMovement = archetypes[entity->type].moveSpeed;
+    if (position.x < entity->targetPosition.x) {
       if (CanMove((Vector2){entityHitbox.x + entityHitbox.width + deltaMovement,
                             entityHitbox.y},
                   entity)) {
-        entity->position.x += deltaMovement;
-        if (entity->position.x > entity->targetPosition.x) {
-          entity->position.x = entity->targetPosition.x;
+        position.x += deltaMovement;
+        if (position.x > entity->targetPosition.x) {
+          position.x = entity->targetPosition.x;
         }
       }
-    } else if (entity->position.x > entity->targetPosition.x) {
+    } else if (position.x > entity->targetPosition.x) {
       if (CanMove((Vector2){entityHitbox.x - deltaMovement, entityHitbox.y},
                   entity)) {
-        entity->position.x -= deltaMovement;
-        if (entity->position.x < entity->targetPosition.x) {
-          entity->position.x = entity->targetPosition.x;
+        position.x -= deltaMovement;
+        if (position.x < entity->targetPosition.x) {
+          position.x = entity->targetPosition.x;
         }
       }
     }
-    if (entity->position.y < entity->targetPosition.y) {
+    if (position.y < entity->targetPosition.y) {
       if (CanMove(
               (Vector2){entityHitbox.x,
                         entityHitbox.y + entityHitbox.height + deltaMovement},
               entity)) {
-        entity->position.y += deltaMovement;
-        if (entity->position.y > entity->targetPosition.y) {
-          entity->position.y = entity->targetPosition.y;
+        position.y += deltaMovement;
+        if (position.y > entity->targetPosition.y) {
+          position.y = entity->targetPosition.y;
         }
       }
-    } else if (entity->position.y > entity->targetPosition.y) {
+    } else if (position.y > entity->targetPosition.y) {
       if (CanMove((Vector2){entityHitbox.x, entityHitbox.y - deltaMovement},
                   entity)) {
-        entity->position.y -= deltaMovement;
-        if (entity->position.y < entity->targetPosition.y) {
-          entity->position.y = entity->targetPosition.y;
+        position.y -= deltaMovement;
+        if (position.y < entity->targetPosition.y) {
+          position.y = entity->targetPosition.y;
         }
       }
     }
+    entitiesNextPosition[i] = position;
   }
 }
 
-static bool CanMove(Vector2 nextPosition, Entity *currentEntity) {
+// Speeds are in pixels per simulation tick
+static void ProcessMovements(void) {
+  JobGroup group = {0};
+  JobsParallelFor(entitiesSize, MOVEMENTS_GRAIN_SIZE, ComputeNextPositions,
+                  NULL, &group);
+  JobsWait(&group);
   for (int i = 0; i < entitiesSize; i++) {
     Entity *entity = &entities[i];
-    if (currentEntity == entity)
+    if (entity->position.x == entitiesNextPosition[i].x &&
+        entity->position.y == entitiesNextPosition[i].y)
       continue;
-    GameTexture texture = EntityToTexture(entity->type);
-    Rectangle hitbox = GetEntityHitbox(entity);
-    if (CheckCollisionPointRec(nextPosition, hitbox)) {
-      return false;
+    MoveInEntitiesGrid(i, entitiesNextPosition[i]);
+    entity->position = entitiesNextPosition[i];
+    UpdateEntityHash(i);
+    RecordEntityChange(i);
+  }
+}
+
+// Only looks at the entities around, however many there are
+static bool CanMove(Vector2 nextPosition, Entity *currentEntity) {
+  SpatialItem around[NEARBY_ENTITIES_MAX];
+  SpatialCursor cursor =
+      StartEntitiesAround((Rectangle){nextPosition.x, nextPosition.y, 0, 0},
+                          ALL_ENTITY_TYPES_MASK);
+  int count;
+  while ((count = NextSpatialItems(&entitiesGrid, &cursor, around,
+                                   NEARBY_ENTITIES_MAX)) > 0) {
+    for (int k = 0; k < count; k++) {
+      Entity *entity = &entities[around[k].id];
+      if (currentEntity == entity)
+        continue;
+      Rectangle hitbox = GetEntityHitbox(entity);
+      if (CheckCollisionPointRec(nextPosition, hitbox)) {
+        return false;
+      }
     }
   }
   return true;
 }
 
 static Rectangle GetEntityHitbox(Entity *entity) {
-  return (Rectangle){.x = entity->position.x + entity->relativeHitbox.x,
-                     .y = entity->position.y + entity->relativeHitbox.y,
-                     .width = entity->relativeHitbox.width,
-                     .height = entity->relativeHitbox.height};
+  Rectangle relativeHitbox = archetypes[entity->type].relativeHitbox;
+  return (Rectangle){.x = entity->position.x + relativeHitbox.x,
+                     .y = entity->position.y + relativeHitbox.y,
+                     .width = relativeHitbox.width,
+                     .height = relativeHitbox.height};
 }
 
 const Color BACKGROUND = BLACK;
+const Color FOG_UNEXPLORED_COLOR = BLACK;
+const Color FOG_EXPLORED_COLOR = {0, 0, 0, 128};
+const Color FOG_EXPLORED_TINT = {128, 128, 128, 255}; // Of what is under it
+const Color ENEMY_TINT = {255, 110, 110, 255};
 const int MARGIN = 20;
+const int CULLING_GRAIN_SIZE = 1024;
 
-static void RenderMainGame(void) {
-  float screenWidth = GetScreenWidth();
-  float screenHeight = GetScreenHeight();
+// What does not move stays shown as last seen once its tile is explored, the
+// rest only while in sight
+static bool IsEntityRevealed(EntitySnapshot *entity) {
+  bool isStatic = archetypes[entity->type].moveSpeed == 0;
+  return entity->fog == FOG_NONE || (entity->fog == FOG_EXPLORED && isStatic);
+}
 
-  BeginMode2D(camera);
+typedef struct CullingData {
+  Rectangle view;
+  RenderSnapshot *snapshot;
+} CullingData;
 
-  ClearBackground(BACKGROUND);
+static void CullEntities(void *data, int start, int end) {
+  TRACE_BEGIN("CullEntities");
+  CullingData *culling = (CullingData *)data;
+  for (int i = start; i < end; i++) {
+    EntitySnapshot *entity = &culling->snapshot->entities[i];
+    Archetype *archetype = &archetypes[entity->type];
+    Rectangle bounds = {entity->position.x, entity->position.y,
+                        archetype->frameWidth, archetype->frameHeight};
+    entity->isVisible =
+        IsEntityRevealed(entity) && CheckCollisionRecs(culling->view, bounds);
+  }
+  TRACE_END("CullEntities");
+}
 
-  // Draw Map
+// ANIMATIONS
 
-  int i, j;
-  int iMin = ToXInvertedIso(camera.target.x, camera.target.y) - 50;
-  int jMin = ToYInvertedIso(camera.target.x, camera.target.y) - 50;
-  int iMax = iMin + 100;
-  int jMax = jMin + 100;
-  if (iMin < 0) {
-    iMin = 0;
+// Spreads the entities over the loop so the same ones do not move in sync
+static float GetAnimationPhase(int entityIndex) {
+  float phase = entityIndex * 0.618034f; // Golden ratio, evenly spread
+  return phase - (int)phase;
+}
+
+// Frame to draw at time, from 0. Nothing is stored per entity so drawing
+// never writes to them, and single frame textures cost nothing.
+static int GetAnimationFrame(Archetype *archetype, float phase, double time) {
+  int framesCount = archetype->framesCount;
+  if (framesCount <= 1)
+    return 0;
+  double loopDuration = archetype->frameDuration * framesCount;
+  double loops = time / loopDuration + phase;
+  // Modulo as the fraction may round up to 1
+  return (int)((loops - (long long)loops) * framesCount) % framesCount;
+}
+
+// Time at which the frame drawn at time gets replaced, INFINITY when the
+// texture is not animated
+static double GetAnimationFrameEnd(Archetype *archetype, float phase,
+                                   double time) {
+  int framesCount = archetype->framesCount;
+  if (framesCount <= 1)
+    return INFINITY;
+  double frameDuration = archetype->frameDuration;
+  double frames = time / frameDuration + phase * framesCount;
+  return ((long long)frames + 1 - phase * framesCount) * frameDuration;
+}
+
+// TERRAIN
+
+// Range of tiles whose texture overlaps view, maxima excluded
+static void GetVisibleTiles(Rectangle view, int *iMin, int *jMin, int *iMax,
+                            int *jMax) {
+  // Tiles are drawn from their top left corner
+  float left = view.x - grassTexture.texture.width;
+  float top = view.y - grassTexture.texture.height;
+  float right = view.x + view.width;
+  float bottom = view.y + view.height;
+  Vector2 corners[4] = {{left, top}, {right, top}, {left, bottom},
+                        {right, bottom}};
+  float iLow = mapSize.x, jLow = mapSize.y, iHigh = 0.0f, jHigh = 0.0f;
+  for (int c = 0; c < 4; c++) {
+    float i = ToXInvertedIso(corners[c].x, corners[c].y);
+    float j = ToYInvertedIso(corners[c].x, corners[c].y);
+    iLow = i < iLow ? i : iLow;
+    jLow = j < jLow ? j : jLow;
+    iHigh = i > iHigh ? i : iHigh;
+    jHigh = j > jHigh ? j : jHigh;
+  }
+  // One more tile on each side for the rounding of the inverse projection
+  *iMin = iLow - 1 > 0 ? (int)iLow - 1 : 0;
+  *jMin = jLow - 1 > 0 ? (int)jLow - 1 : 0;
+  *iMax = iHigh + 2 < mapSize.x ? (int)iHigh + 2 : mapSize.x;
+  *jMax = jHigh + 2 < mapSize.y ? (int)jHigh + 2 : mapSize.y;
+}
+
+// Scale of the impostors of a level, fixed by their texture width
+static float GetTerrainImpostorScale(int level) {
+  return (float)TERRAIN_IMPOSTOR_WIDTH /
+         (terrainBlockSizes[level] * grassTexture.texture.width);
+}
+
+// Renders every tile type as blocks of each level, premultiplied by alpha so
+// they blend like the tiles they replace
+static void InitTerrainImpostors(void) {
+  rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE,
+                            RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD, RL_FUNC_ADD);
+  for (int level = 0; level < TERRAIN_LOD_LEVELS; level++) {
+    int blockSize = terrainBlockSizes[level];
+    float scale = GetTerrainImpostorScale(level);
+    for (int tile = 0; tile < TILES_COUNT; tile++) {
+      GameTexture *texture = tileTextures[tile];
+      RenderTexture2D *impostor = &terrainImpostors[level][tile];
+      *impostor = LoadRenderTexture(
+          TERRAIN_IMPOSTOR_WIDTH,
+          (blockSize + 1) * texture->texture.height / 2.0f * scale);
+      BeginTextureMode(*impostor);
+      ClearBackground(BLANK);
+      BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+      for (int j = 0; j < blockSize; j++) {
+        for (int i = 0; i < blockSize; i++) {
+          Vector2 position = {
+              (ToXIso(i, j) - ToXIso(0, blockSize - 1)) * scale,
+              (ToYIso(i, j) - ToYIso(0, 0)) * scale};
+          DrawTextureEx(texture->texture, position, 0.0f, scale, WHITE);
+        }
+      }
+      EndBlendMode();
+      EndTextureMode();
+      GenTextureMipmaps(&impostor->texture);
+      SetTextureFilter(impostor->texture, TEXTURE_FILTER_TRILINEAR);
+    }
+  }
+  areTerrainImpostorsLoaded = true;
+}
+
+static void FreeTerrainImpostors(void) {
+  if (!areTerrainImpostorsLoaded)
+    return;
+  for (int level = 0; level < TERRAIN_LOD_LEVELS; level++) {
+    for (int tile = 0; tile < TILES_COUNT; tile++) {
+      UnloadRenderTexture(terrainImpostors[level][tile]);
+    }
+  }
+  areTerrainImpostorsLoaded = false;
+}
+
+// Computes the type of every block of every level, after the map changed
+static void InitTerrainBlocks(void) {
+  for (int level = 0; level < TERRAIN_LOD_LEVELS; level++) {
+    int blockSize = terrainBlockSizes[level];
+    int blocksWidth = (mapSize.x + blockSize - 1) / blockSize;
+    int blocksHeight = (mapSize.y + blockSize - 1) / blockSize;
+    free(terrainBlocks[level]);
+    terrainBlocks[level] =
+        (int *)malloc(blocksWidth * blocksHeight * sizeof(int));
+    for (int bj = 0; bj < blocksHeight; bj++) {
+      for (int bi = 0; bi < blocksWidth; bi++) {
+        int i0 = bi * blockSize, j0 = bj * blockSize;
+        int tile = map[i0][j0];
+        if (i0 + blockSize > mapSize.x || j0 + blockSize > mapSize.y)
+          tile = -1;
+        for (int j = j0; tile >= 0 && j < j0 + blockSize; j++) {
+          for (int i = i0; i < i0 + blockSize; i++) {
+            if (map[i][j] != tile) {
+              tile = -1;
+              break;
+            }
+          }
+        }
+        terrainBlocks[level][bj * blocksWidth + bi] = tile;
+      }
+    }
+  }
+}
+
+static void FreeTerrainBlocks(void) {
+  for (int level = 0; level < TERRAIN_LOD_LEVELS; level++) {
+    free(terrainBlocks[level]);
+    terrainBlocks[level] = NULL;
+  }
+}
+
+// Draws the tiles of the range overlapping view. The range is a bounding box
+// of the view in tiles, about half of it is outside the view: each row is
+// clipped to the tiles whose texture x and y overlap the view.
+static void DrawTiles(Rectangle view, int iMin, int jMin, int iMax, int jMax) {
+  float halfWidth = grassTexture.texture.width / 2.0f;
+  float quarterHeight = grassTexture.texture.height / 4.0f;
+  for (int j = jMin; j < jMax; j++) {
+    // ToXIso(i, j) + width >= view.x and ToXIso(i, j) <= view.x + view.width
+    float rowMin = (view.x - 2.0f * halfWidth) / halfWidth + j;
+    float rowMax = (view.x + view.width) / halfWidth + j;
+    // Same with ToYIso(i, j) and the view height
+    float yMin = (view.y - 4.0f * quarterHeight) / quarterHeight - j;
+    float yMax = (view.y + view.height) / quarterHeight - j;
+    rowMin = yMin > rowMin ? yMin : rowMin;
+    rowMax = yMax < rowMax ? yMax : rowMax;
+    int rowStart = rowMin > iMin ? (int)rowMin : iMin;
+    int rowEnd = rowMax + 1 < iMax ? (int)rowMax + 1 : iMax;
+    for (int i = rowStart; i < rowEnd; i++) {
+      DrawTexture(tileTextures[map[i][j]]->texture, ToXIso(i, j), ToYIso(i, j),
+                  WHITE);
+    }
   }
-  if (jMin < 0) {
-    jMin = 0;
+}
+
+// Draws the tiles in view, or the impostors of the coarsest level still as
+// sharp as the zoom so the cost stays bounded when zoomed out
+static void DrawTerrain(Rectangle view, float zoom) {
+  int iMin, jMin, iMax, jMax;
+  GetVisibleTiles(view, &iMin, &jMin, &iMax, &jMax);
+  int level = -1;
+  while (level + 1 < TERRAIN_LOD_LEVELS && areTerrainImpostorsLoaded &&
+         GetTerrainImpostorScale(level + 1) >= zoom) {
+    level++;
+  }
+  if (level < 0) {
+    DrawTiles(view, iMin, jMin, iMax, jMax);
+    return;
   }
-  if (jMax > mapSize.y) {
-    jMax = mapSize.y;
+  int blockSize = terrainBlockSizes[level];
+  int blocksWidth = (mapSize.x + blockSize - 1) / blockSize;
+  float tileWidth = grassTexture.texture.width;
+  float tileHeight = grassTexture.texture.height;
+  // Impostors are premultiplied, mixed blocks are drawn by tiles afterwards
+  BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+  for (int bj = jMin / blockSize; bj * blockSize < jMax; bj++) {
+    for (int bi = iMin / blockSize; bi * blockSize < iMax; bi++) {
+      int tile = terrainBlocks[level][bj * blocksWidth + bi];
+      if (tile < 0)
+        continue;
+      Texture2D impostor = terrainImpostors[level][tile].texture;
+      int i0 = bi * blockSize, j0 = bj * blockSize;
+      DrawTexturePro(impostor,
+                     (Rectangle){0, 0, impostor.width, -impostor.height},
+                     (Rectangle){ToXIso(i0, j0 + blockSize - 1),
+                                 ToYIso(i0, j0), blockSize * tileWidth,
+                                 (blockSize + 1) * tileHeight / 2.0f},
+                     (Vector2){0, 0}, 0.0f, WHITE);
+    }
   }
-  if (iMax > mapSize.x) {
-    iMax = mapSize.x;
+  EndBlendMode();
+  for (int bj = jMin / blockSize; bj * blockSize < jMax; bj++) {
+    for (int bi = iMin / blockSize; bi * blockSize < iMax; bi++) {
+      if (terrainBlocks[level][bj * blocksWidth + bi] >= 0)
+        continue;
+      int i0 = bi * blockSize, j0 = bj * blockSize;
+      DrawTiles(view, i0 > iMin ? i0 : iMin, j0 > jMin ? j0 : jMin,
+                i0 + blockSize < iMax ? i0 + blockSize : iMax,
+                j0 + blockSize < jMax ? j0 + blockSize : jMax);
+    }
   }
-  for (j = jMin; j < jMax; j++) {
-    for (i = iMin; i < iMax; i++) {
-      float x = ToXIso(i, j);
-      float y = ToYIso(i, j);
-      GameTexture texture = TileToTexture(map[i][j]);
-      DrawTexture(texture.texture, x, y, WHITE);
+}
+
+// Covers the tiles i0 to i1 of row j, a parallelogram of their diamonds
+static void DrawFogRun(int i0, int i1, int j, Color color) {
+  float halfWidth = grassTexture.texture.width / 2.0f;
+  float quarterHeight = grassTexture.texture.height / 4.0f;
+  Vector2 top = {ToXIso(i0, j) + halfWidth, ToYIso(i0, j)};
+  Vector2 left = {ToXIso(i0, j), ToYIso(i0, j) + quarterHeight};
+  Vector2 bottom = {ToXIso(i1, j) + halfWidth,
+                    ToYIso(i1, j) + 2.0f * quarterHeight};
+  Vector2 right = {ToXIso(i1, j) + 2.0f * halfWidth,
+                   ToYIso(i1, j) + quarterHeight};
+  DrawTriangle(top, left, bottom, color);
+  DrawTriangle(top, bottom, right, color);
+}
+
+// Hides the unexplored tiles in view and darkens the explored ones out of
+// sight, one quad per run of tiles with the same fog along a row
+static void DrawFog(RenderSnapshot *snapshot, Rectangle view) {
+  int width = mapSize.x;
+  if (snapshot->tilesWordsCount * 64 < width * (int)mapSize.y)
+    return; // Not published yet
+  int iMin, jMin, iMax, jMax;
+  GetVisibleTiles(view, &iMin, &jMin, &iMax, &jMax);
+  for (int j = jMin; j < jMax; j++) {
+    int runEnd;
+    for (int i = iMin; i < iMax; i = runEnd) {
+      Fog fog = GetTileFog(snapshot->visibleTiles, snapshot->exploredTiles,
+                           j * width + i);
+      runEnd = i + 1;
+      while (runEnd < iMax &&
+             GetTileFog(snapshot->visibleTiles, snapshot->exploredTiles,
+                        j * width + runEnd) == fog) {
+        runEnd++;
+      }
+      if (fog != FOG_NONE)
+        DrawFogRun(i, runEnd - 1, j,
+                   fog == FOG_EXPLORED ? FOG_EXPLORED_COLOR
+                                       : FOG_UNEXPLORED_COLOR);
     }
   }
+}
+
+// Entity types drawn with instanced draw calls, NULL for the others. Trees
+// are by far the most numerous entities and never move. Only the visible
+// ones are instances, drawn in runs between the other entities so the entity
+// order stays the draw order: a frame makes one more draw call per switch
+// from trees to another visible entity.
+static InstancedSprites *GetInstancedSprites(EntityType type) {
+  if (!useInstancedSprites)
+    return NULL;
+  switch (type) {
+  case TREE:
+    return &treesSprites;
+  default:
+    return NULL;
+  }
+}
+
+static void RenderMainGame(RenderSnapshot *snapshot) {
+  float screenWidth = GetScreenWidth();
+  float screenHeight = GetScreenHeight();
+
+  // Same view as camera, in render target pixels
+  float targetScale = renderTarget.texture.width / screenWidth;
+  Camera2D renderCamera = camera;
+  renderCamera.offset.x *= targetScale;
+  renderCamera.offset.y *= targetScale;
+  renderCamera.zoom *= targetScale;
+  BeginMode2D(renderCamera);
+
+  ClearBackground(BACKGROUND);
+
+  Vector2 viewStart = GetScreenToWorld2D((Vector2){0, 0}, camera);
+  Vector2 viewEnd =
+      GetScreenToWorld2D((Vector2){screenWidth, screenHeight}, camera);
+
+  // Draw Map
+
+  int i;
+  DrawTerrain((Rectangle){viewStart.x, viewStart.y, viewEnd.x - viewStart.x,
+                          viewEnd.y - viewStart.y},
+              renderCamera.zoom);
+  DrawFog(snapshot, (Rectangle){viewStart.x, viewStart.y,
+                                viewEnd.x - viewStart.x,
+                                viewEnd.y - viewStart.y});
 
   // Draw entities
-  for (i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    GameTexture texture = EntityToTexture(entity->type);
-    int x = entity->position.x;
-    int y = entity->position.y;
-    int animWidth = texture.texture.width / texture.animFramesNumber;
-    int animOffset = entity->animCurrentFrame * animWidth;
-    Color textureColor = WHITE;
+  CullingData culling = {
+      .view = {viewStart.x, viewStart.y, viewEnd.x - viewStart.x,
+               viewEnd.y - viewStart.y},
+      .snapshot = snapshot};
+  JobGroup cullingGroup = {0};
+  JobsParallelFor(snapshot->entitiesSize, CULLING_GRAIN_SIZE, CullEntities,
+                  &culling, &cullingGroup);
+  JobsWait(&cullingGroup);
+  if (useInstancedSprites) {
+    BeginSpriteInstances(&treesSprites);
+  }
+  double animationTime = GetTime();
+  worldAnimationsEnd = INFINITY;
+  for (i = 0; i < snapshot->entitiesSize; i++) {
+    EntitySnapshot *entity = &snapshot->entities[i];
+    Archetype *archetype = &archetypes[entity->type];
+    int frame = GetAnimationFrame(archetype, entity->animPhase, animationTime);
+    InstancedSprites *sprites = GetInstancedSprites(entity->type);
+    Color textureColor = entity->fog != FOG_NONE     ? FOG_EXPLORED_TINT
+                         : entity->team != TEAM_PLAYER ? ENEMY_TINT
+                                                       : WHITE;
     if (entity->isSelected) {
       textureColor = (Color){66, 245, 102, 220};
     }
-    DrawTextureRec(
-        texture.texture,
-        (Rectangle){animOffset, 0, animWidth, texture.texture.height},
-        (Vector2){x, y}, textureColor);
+    if (entity->isVisible) {
+      double frameEnd =
+          GetAnimationFrameEnd(archetype, entity->animPhase, animationTime);
+      if (frameEnd < worldAnimationsEnd)
+        worldAnimationsEnd = frameEnd;
+    }
+    if (!entity->isVisible)
+      continue;
+    if (sprites) {
+      AddSpriteInstance(sprites, (SpriteInstance){.position = entity->position,
+                                                  .frame = frame,
+                                                  .tint = textureColor});
+      continue;
+    }
+    if (useInstancedSprites) {
+      DrawInstancedSprites(&treesSprites); // The trees before this entity
+    }
+    int x = entity->position.x;
+    int y = entity->position.y;
+    DrawTextureRec(archetype->texture->texture,
+                   (Rectangle){frame * archetype->frameWidth, 0,
+                               archetype->frameWidth, archetype->frameHeight},
+                   (Vector2){x, y}, textureColor);
     if (toggleHitboxes) {
-      Rectangle entityHitbox = GetEntityHitbox(entity);
-      DrawRectangleRec(entityHitbox, BLACK);
+      DrawRectangleRec(entity->hitbox, BLACK);
     }
-    entity->animCurrentFrame++;
-    if (entity->animCurrentFrame > texture.animFramesNumber) {
-      entity->animCurrentFrame = 1;
+  }
+  if (useInstancedSprites) {
+    DrawInstancedSprites(&treesSprites);
+    for (i = 0; toggleHitboxes && i < snapshot->entitiesSize; i++) {
+      EntitySnapshot *entity = &snapshot->entities[i];
+      if (entity->isVisible && GetInstancedSprites(entity->type))
+        DrawRectangleRec(entity->hitbox, BLACK);
     }
   }
 
@@ -385,174 +1373,2401 @@ static void RenderMainGame(void) {
   }
 
   EndMode2D();
+}
 
+static void RenderHud(RenderSnapshot *snapshot) {
   if (toggleHelp) {
-    DrawHelpWindow(screenWidth, screenHeight);
+    DrawHudTexture(helpTexture, GetScreenWidth() / 4, GetScreenHeight() / 4);
   }
 
-  DrawTopHud();
+  DrawMinimap();
+  DrawHudTexture(topHudTexture, 0, 0);
+  if (toggleDebugOverlay) {
+    DrawDebugOverlay(snapshot);
+  }
 }
 
-static void DrawHelpWindow(int screenWidth, int screenHeight) {
-  DrawRectangle(screenWidth / 4, screenHeight / 4, screenWidth / 2,
-                screenHeight / 2, BLACK);
+static void DrawHelpWindow(int width, int height) {
+  DrawRectangle(0, 0, width, height, BLACK);
   const char *helpText =
-      "ACTION KEYS\nENTER - Show hitboxes\nS - Build a shelter "
-      "(+5 pop). Cost:  50 wood.";
-  DrawText(helpText, screenWidth / 4 + MARGIN, screenHeight / 4 + MARGIN,
-           GAME_FONT_SIZE, WHITE);
+      "ACTION KEYS\nENTER - Show hitboxes\nF3 - Show debug overlay\nS - "
+      "Build a shelter (+5 pop). Cost:  50 wood.\nC - Build a city hall "
+      "(trains units, drop-off). Cost: 300 wood.\nV - Train a villager at "
+      "the city hall nearest the view center. Cost: 50 food.\nM - Train a "
+      "soldier, same way. Cost: 60 food, 20 wood.\nR - Train an archer, same "
+      "way. Cost: 30 food, 40 wood.\nRight click on a tree - Gather wood "
+      "with the selected villagers\nRight click on an enemy - Attack it with "
+      "the selected soldier or archer";
+  if (traceIsEnabled)
+    helpText = TextFormat("%s\nF4 - Write the trace", helpText);
+  DrawText(helpText, MARGIN, MARGIN, GAME_FONT_SIZE, WHITE);
 }
 
-static void DrawTopHud(void) {
+static void DrawTopHud(RenderSnapshot *snapshot, int fps) {
   int screenWidth = GetScreenWidth();
   DrawRectangle(0, 0, screenWidth, MARGIN * 2, BLACK);
   const char *resourcesText =
       TextFormat("Wood : %i - Stone : %i - Gold : %i, Food : %i - Population : "
-                 "%i/%i -  Press h for actions",
-                 resources.wood, resources.stone, resources.gold,
-                 resources.food, GetPopulation(), GetMaxPopulation());
+                 "%i/%i (+%i) -  Press h for actions",
+                 snapshot->resources.wood, snapshot->resources.stone,
+                 snapshot->resources.gold, snapshot->resources.food,
+                 snapshot->population, snapshot->maxPopulation,
+                 snapshot->queuedPopulation);
   DrawText(resourcesText, MARGIN, MARGIN, GAME_FONT_SIZE, WHITE);
-  DrawFPS(screenWidth - MARGIN - MeasureText("120 FPS", GAME_FONT_SIZE),
-          MARGIN);
+  // Same colors as DrawFPS, which can only show the current value
+  Color fpsColor = fps < 15 ? RED : fps < 30 ? ORANGE : LIME;
+  DrawText(TextFormat("%2i FPS", fps),
+           screenWidth - MARGIN - MeasureText("120 FPS", GAME_FONT_SIZE),
+           MARGIN, GAME_FONT_SIZE, fpsColor);
 }
 
-// ENTITIES HELPERS
+// HUD TEXTURES
+//
+// The top bar and the help window are rendered to textures, again only when
+// the values they show change, the FPS counter being sampled at
+// HUD_FPS_UPDATE_RATE. Drawing them is then a single quad each instead of
+// formatting and rasterizing their text every frame. They are rendered at
+// the framebuffer resolution so text stays sharp on high DPI screens.
 
-static Entity CreateEntity(EntityType entityType, Vector2 position) {
-  switch (entityType) {
-  case VILLAGER:
-    return createVillagerEntity(position);
-    break;
-  case CITY_HALL:
-    return createCityHallEntity(position);
-    break;
-  case SHELTER:
-    return createShelterEntity(position);
-    break;
-  case TREE:
-    return createTreeEntity(position);
-    break;
-  }
+static float GetHudScale(void) {
+  return (float)GetRenderWidth() / GetScreenWidth();
 }
 
-static void AddToEntities(EntityType entityType, Vector2 position) {
-  entitiesSize += 1;
-  if (entitiesSize >= entitiesCapacity) {
-    entitiesCapacity *= 2;
-    entities = realloc(entities, entitiesCapacity * sizeof(Entity));
-  }
-  entities[entitiesSize - 1] = CreateEntity(entityType, position);
+// Reloads texture when its size in screen pixels changed, returns true when
+// it did and its content is lost
+static bool UpdateHudTexture(RenderTexture2D *texture, int width, int height) {
+  float scale = GetHudScale();
+  int textureWidth = width * scale;
+  int textureHeight = height * scale;
+  if (texture->id && texture->texture.width == textureWidth &&
+      texture->texture.height == textureHeight)
+    return false;
+  if (texture->id)
+    UnloadRenderTexture(*texture);
+  *texture = LoadRenderTexture(textureWidth, textureHeight);
+  return true;
 }
 
-// SELECTED ENTITIES HELPERS
-
-static void AddToSelectedEntities(Entity *entity) { entity->isSelected = true; }
-
-// INITS
-
-static void InitCamera(void) {
-  float screenWidth = GetScreenWidth();
-  float screenHeight = GetScreenHeight();
-  float map_center_x = ToXIso(mapSize.x / 2, mapSize.y / 2);
-  float map_center_y = ToYIso(mapSize.x / 2, mapSize.y / 2);
-  camera.target = (Vector2){map_center_x, map_center_y};
-  camera.offset = (Vector2){screenWidth / 2.0f, screenHeight / 2.0f};
-  camera.rotation = 0.0f;
-  camera.zoom = 0.3f;
+// Drawing is then done in screen pixels
+static void BeginHudTextureMode(RenderTexture2D texture) {
+  BeginTextureMode(texture);
+  ClearBackground(BLANK);
+  float scale = GetHudScale();
+  rlPushMatrix();
+  rlScalef(scale, scale, 1.0f);
 }
 
-static void InitTextures(void) {
-  // MAP TILES
-  grassTexture = (GameTexture){.texture = LoadTexture("assets/map/grass.png"),
-                               .animFramesNumber = 1};
-
-  // Buildings
-  primitiveCityHallTexture = (GameTexture){
-      .texture = LoadTexture("assets/primitive/buildings/cityHall.png"),
-      .animFramesNumber = 7,
-      .entityType = CITY_HALL};
-  primitiveShelterTexture = (GameTexture){
-      .texture = LoadTexture("assets/primitive/buildings/shelter.png"),
-      .animFramesNumber = 1,
-      .entityType = SHELTER};
-
-  // Units
-  primitiveVillagerTexture = (GameTexture){
-      .texture = LoadTexture("assets/primitive/units/villager.png"),
-      .animFramesNumber = 1,
-      .entityType = VILLAGER};
-
-  // Resources
-  treeTexture =
-      (GameTexture){.texture = LoadTexture("assets/resources/tree.png"),
-                    .animFramesNumber = 1,
-                    .entityType = TREE};
+static void EndHudTextureMode(void) {
+  rlPopMatrix();
+  EndTextureMode();
 }
 
-static void FreeTextures(void) {
-  UnloadTexture(grassTexture.texture);
-  UnloadTexture(primitiveCityHallTexture.texture);
-  UnloadTexture(primitiveVillagerTexture.texture);
+static void DrawHudTexture(RenderTexture2D texture, float x, float y) {
+  float scale = GetHudScale();
+  DrawTexturePro(texture.texture,
+                 (Rectangle){0, 0, (float)texture.texture.width,
+                             (float)-texture.texture.height},
+                 (Rectangle){x, y, texture.texture.width / scale,
+                             texture.texture.height / scale},
+                 (Vector2){0, 0}, 0.0f, WHITE);
 }
 
-void InitMap(void) {
-  int i, j;
-  map = (enum Tile **)malloc(mapSize.y * sizeof(enum Tile *));
-  for (i = 0; i < mapSize.y; i++) {
-    map[i] = (enum Tile *)malloc(mapSize.x * sizeof(enum Tile));
+// Must be called outside of BeginDrawing
+static void UpdateHud(RenderSnapshot *snapshot) {
+  int screenWidth = GetScreenWidth();
+  int screenHeight = GetScreenHeight();
+  double now = GetTime();
+  if (now - hudFpsTime >= 1.0 / HUD_FPS_UPDATE_RATE) {
+    hudFps = GetFPS();
+    hudFpsTime = now;
   }
-  for (i = 0; i < mapSize.y; i++) {
-    for (j = 0; j < mapSize.x; j++) {
-      map[i][j] = GRASS;
-    }
+  HudView view = GetHudView(snapshot);
+  bool isTopHudLost =
+      UpdateHudTexture(&topHudTexture, screenWidth, MARGIN * 2);
+  if (isTopHudLost || hudFps != topHudFps ||
+      memcmp(&view, &topHudView, sizeof(view)) != 0) {
+    BeginHudTextureMode(topHudTexture);
+    DrawTopHud(snapshot, hudFps);
+    EndHudTextureMode();
+    topHudView = view;
+    topHudFps = hudFps;
   }
+  // Static text, only rendered again when resized
+  if (toggleHelp &&
+      UpdateHudTexture(&helpTexture, screenWidth / 2, screenHeight / 2)) {
+    BeginHudTextureMode(helpTexture);
+    DrawHelpWindow(screenWidth / 2, screenHeight / 2);
+    EndHudTextureMode();
+  }
+}
+
+static void FreeHud(void) {
+  if (topHudTexture.id)
+    UnloadRenderTexture(topHudTexture);
+  if (helpTexture.id)
+    UnloadRenderTexture(helpTexture);
+  topHudTexture = helpTexture = (RenderTexture2D){0};
 }
 
-void InitEntities(void) {
-  entitiesSize = 0;
-  entities = (Entity *)malloc(entitiesCapacity * sizeof(Entity));
+static void DrawDebugOverlay(RenderSnapshot *snapshot) {
+  const char *debugText =
+      TextFormat("Tick : %u - State hash : %016llx - Entities : %i - Render "
+                 "scale : %i%% (%ix%i, CPU %.1f ms)",
+                 snapshot->tick, (unsigned long long)snapshot->stateHash,
+                 snapshot->entitiesSize, (int)(renderScale * 100.0f + 0.5f),
+                 renderTarget.texture.width, renderTarget.texture.height,
+                 averageCpuTime * 1000.0);
+  DrawRectangle(0, MARGIN * 2, MeasureText(debugText, GAME_FONT_SIZE) +
+                                   MARGIN * 2, MARGIN * 2, BLACK);
+  DrawText(debugText, MARGIN, MARGIN * 3, GAME_FONT_SIZE, WHITE);
+  const char *memoryText = TextFormat(
+      "Textures VRAM : %.1f MB (%.1f MB as RGBA8), %s",
+      texturesMemorySize / (1024.0 * 1024.0),
+      texturesRgbaMemorySize / (1024.0 * 1024.0),
+      isDxtSupported ? "DXT sprites" : "no S3TC: RGBA8 only");
+  DrawRectangle(0, MARGIN * 4, MeasureText(memoryText, GAME_FONT_SIZE) +
+                                   MARGIN * 2, MARGIN * 2, BLACK);
+  DrawText(memoryText, MARGIN, MARGIN * 5, GAME_FONT_SIZE, WHITE);
+}
 
-  int mapCenterX = camera.target.x;
-  int mapCenterY = camera.target.y;
+// MINIMAP
+//
+// One texel per tile, the terrain with the entities on top, drawn as a
+// diamond like the map. Built from the first snapshot of a game, then only
+// the texels of the entities listed as changed by the snapshots are
+// recomputed and uploaded, so its cost does not depend on the world size.
+// Fog hides it as it hides the world: nothing on unexplored tiles, only what
+// does not move, darkened, on explored ones out of sight. When the vision
+// changes, only the texels whose fog bits changed are recomputed.
 
-  // CITY_HALL
-  AddToEntities(CITY_HALL, (Vector2){mapCenterX, mapCenterY});
+static const Color minimapLayersColor[MINIMAP_LAYERS] = {
+    {66, 135, 245, 255}, // Units
+    {230, 230, 230, 255}, // Buildings
+    {20, 90, 30, 255}};   // Resources
 
-  // VILLAGERS
-  AddToEntities(VILLAGER, (Vector2){mapCenterX - 400, mapCenterY});
-  AddToEntities(VILLAGER, (Vector2){mapCenterX, mapCenterY - 400});
-  AddToEntities(VILLAGER, (Vector2){mapCenterX, mapCenterY + 1100});
-
-  const int MAP_CENTER_AREA = 1500;
-  int seed = (int)time(NULL);
-  perlin_init(seed);
-  for (int j = 0; j < mapSize.y; j++) {
-    for (int i = 0; i < mapSize.x; i++) {
-      double perlinNoiseValue = perlin2D_octaves(i * 0.1f, j * 0.1f, 4, 0.5f);
-      if (perlinNoiseValue > 0.25) {
-        Vector2 position = {ToXIso(i, j), ToYIso(i, j)};
-        if (position.x >= mapCenterX - MAP_CENTER_AREA &&
-            position.x <= mapCenterX + MAP_CENTER_AREA &&
-            position.y >= mapCenterY - MAP_CENTER_AREA &&
-            position.y <= mapCenterY + MAP_CENTER_AREA)
-          continue;
-        AddToEntities(TREE, position);
-      }
-    }
+static Color GetMinimapTileColor(enum Tile tile) {
+  switch (tile) {
+  case GRASS:
+  default:
+    return (Color){90, 160, 70, 255};
   }
 }
 
+// Lower layers are drawn above the others
+static int GetMinimapLayer(EntityType type) {
+  switch (type) {
+  case VILLAGER:
+  case SOLDIER:
+  case ARCHER:
+    return 0;
+  case CITY_HALL:
+  case SHELTER:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+// Top corner of the diamond, then its width and height
+static Rectangle GetMinimapBounds(void) {
+  return (Rectangle){MARGIN + MINIMAP_DISPLAY_WIDTH / 2.0f,
+                     GetScreenHeight() - MARGIN - MINIMAP_DISPLAY_WIDTH / 2.0f,
+                     MINIMAP_DISPLAY_WIDTH, MINIMAP_DISPLAY_WIDTH / 2.0f};
+}
+
+// Fractional tile coordinates of a world position
+static Vector2 WorldToTile(Vector2 position) {
+  // Tiles are drawn from the top left corner of their texture
+  float x = position.x - grassTexture.texture.width / 2.0f;
+  return (Vector2){ToXInvertedIso(x, position.y),
+                   ToYInvertedIso(x, position.y)};
+}
+
+static Vector2 TileToMinimap(Vector2 tile) {
+  Rectangle bounds = GetMinimapBounds();
+  float u = tile.x / mapSize.x;
+  float v = tile.y / mapSize.y;
+  return (Vector2){bounds.x + (u - v) * bounds.width / 2.0f,
+                   bounds.y + (u + v) * bounds.height / 2.0f};
+}
+
+static Vector2 MinimapToTile(Vector2 point) {
+  Rectangle bounds = GetMinimapBounds();
+  float x = (point.x - bounds.x) / (bounds.width / 2.0f);
+  float y = (point.y - bounds.y) / (bounds.height / 2.0f);
+  return (Vector2){(y + x) / 2.0f * mapSize.x, (y - x) / 2.0f * mapSize.y};
+}
+
+// Texel and layer an entity is counted in, -1 when outside the map
+static int GetMinimapSlot(EntitySnapshot *entity) {
+  Vector2 tile = WorldToTile((Vector2){
+      entity->hitbox.x + entity->hitbox.width / 2.0f,
+      entity->hitbox.y + entity->hitbox.height});
+  if (tile.x < 0 || tile.y < 0 || tile.x >= mapSize.x || tile.y >= mapSize.y)
+    return -1;
+  int texel = (int)tile.y * (int)mapSize.x + (int)tile.x;
+  return texel * MINIMAP_LAYERS + GetMinimapLayer(entity->type);
+}
+
+static void UpdateMinimapTexel(int texel) {
+  Fog fog = GetTileFog(minimapVisibleTiles, minimapExploredTiles, texel);
+  Color color = GetMinimapTileColor(map[texel % (int)mapSize.x]
+                                       [texel / (int)mapSize.x]);
+  // Units are the only layer that moves, see IsEntityRevealed
+  int topLayer = fog == FOG_NONE ? 0 : 1;
+  for (int layer = MINIMAP_LAYERS - 1; layer >= topLayer; layer--) {
+    if (minimapCounts[texel * MINIMAP_LAYERS + layer] > 0)
+      color = minimapLayersColor[layer];
+  }
+  if (fog == FOG_EXPLORED) {
+    color.r = color.r * FOG_EXPLORED_TINT.r / 255;
+    color.g = color.g * FOG_EXPLORED_TINT.g / 255;
+    color.b = color.b * FOG_EXPLORED_TINT.b / 255;
+  } else if (fog == FOG_UNEXPLORED) {
+    color = FOG_UNEXPLORED_COLOR;
+  }
+  ((Color *)minimapImage.data)[texel] = color;
+  minimapDirtyTexels[minimapDirtyTexelsSize++] = texel;
+}
+
+// Takes the fog of the snapshot, everything is in sight until it is published.
+// Adds one dirty texel at most per tile.
+static void UpdateMinimapFog(RenderSnapshot *snapshot) {
+  int texelsCount = mapSize.x * mapSize.y;
+  bool isPublished = snapshot->tilesWordsCount * 64 >= texelsCount;
+  for (int w = 0; w * 64 < texelsCount; w++) {
+    uint64_t visible = isPublished ? snapshot->visibleTiles[w] : ~0ull;
+    uint64_t explored = isPublished ? snapshot->exploredTiles[w] : ~0ull;
+    uint64_t changed = (visible ^ minimapVisibleTiles[w]) |
+                       (explored ^ minimapExploredTiles[w]);
+    minimapVisibleTiles[w] = visible;
+    minimapExploredTiles[w] = explored;
+    for (int texel = w * 64; changed && texel < texelsCount; texel++) {
+      if (changed & 1)
+        UpdateMinimapTexel(texel);
+      changed >>= 1;
+    }
+  }
+  minimapVisionVersion = snapshot->visionVersion;
+}
+
+// entity is NULL once it was removed
+static void UpdateMinimapEntity(int index, EntitySnapshot *entity) {
+  int slot = entity ? GetMinimapSlot(entity) : -1;
+  int previousSlot = minimapEntityTexels[index];
+  if (slot == previousSlot)
+    return;
+  if (previousSlot >= 0) {
+    minimapCounts[previousSlot]--;
+    UpdateMinimapTexel(previousSlot / MINIMAP_LAYERS);
+  }
+  if (slot >= 0) {
+    minimapCounts[slot]++;
+    UpdateMinimapTexel(slot / MINIMAP_LAYERS);
+  }
+  minimapEntityTexels[index] = slot;
+}
+
+static void ReserveMinimapEntities(int entitiesCount) {
+  if (minimapEntityTexelsCapacity >= entitiesCount)
+    return;
+  int capacity =
+      minimapEntityTexelsCapacity ? minimapEntityTexelsCapacity : 256;
+  while (capacity < entitiesCount) {
+    capacity *= 2;
+  }
+  minimapEntityTexels = realloc(minimapEntityTexels, capacity * sizeof(int));
+  for (int i = minimapEntityTexelsCapacity; i < capacity; i++) {
+    minimapEntityTexels[i] = -1;
+  }
+  minimapEntityTexelsCapacity = capacity;
+}
+
+static void BuildMinimap(RenderSnapshot *snapshot) {
+  int texelsCount = mapSize.x * mapSize.y;
+  if (minimapImage.width != mapSize.x || minimapImage.height != mapSize.y) {
+    FreeMinimap();
+    minimapImage = GenImageColor(mapSize.x, mapSize.y, BLACK);
+    minimapTexture = LoadTextureFromImage(minimapImage);
+    minimapCounts = malloc(texelsCount * MINIMAP_LAYERS * sizeof(short));
+    // Two per entity change at most, and every texel for the build
+    minimapDirtyTexels = malloc(texelsCount * 2 * sizeof(int));
+    minimapUploadBox = malloc(texelsCount * sizeof(Color));
+    int wordsCount = (texelsCount + 63) / 64;
+    minimapVisibleTiles = calloc(wordsCount, sizeof(uint64_t));
+    minimapExploredTiles = calloc(wordsCount, sizeof(uint64_t));
+  }
+  memset(minimapCounts, 0, texelsCount * MINIMAP_LAYERS * sizeof(short));
+  for (int i = 0; i < minimapEntityTexelsCapacity; i++) {
+    minimapEntityTexels[i] = -1;
+  }
+  ReserveMinimapEntities(snapshot->entitiesSize);
+  for (int i = 0; i < snapshot->entitiesSize; i++) {
+    int slot = GetMinimapSlot(&snapshot->entities[i]);
+    if (slot >= 0)
+      minimapCounts[slot]++;
+    minimapEntityTexels[i] = slot;
+  }
+  minimapDirtyTexelsSize = 0;
+  UpdateMinimapFog(snapshot);
+  minimapDirtyTexelsSize = 0;
+  for (int texel = 0; texel < texelsCount; texel++) {
+    UpdateMinimapTexel(texel);
+  }
+  UpdateTexture(minimapTexture, minimapImage.data);
+  minimapDirtyTexelsSize = 0;
+  minimapTick = snapshot->tick;
+  isMinimapStale = false;
+}
+
+// Uploads texels one by one when few changed, else their bounding box
+static void UploadMinimapDirtyTexels(void) {
+  int width = mapSize.x;
+  Color *pixels = (Color *)minimapImage.data;
+  if (minimapDirtyTexelsSize <= MINIMAP_MAX_TEXEL_UPLOADS) {
+    for (int k = 0; k < minimapDirtyTexelsSize; k++) {
+      int texel = minimapDirtyTexels[k];
+      UpdateTextureRec(minimapTexture,
+                       (Rectangle){texel % width, texel / width, 1, 1},
+                       &pixels[texel]);
+    }
+  } else {
+    int xMin = width, yMin = mapSize.y, xMax = 0, yMax = 0;
+    for (int k = 0; k < minimapDirtyTexelsSize; k++) {
+      int x = minimapDirtyTexels[k] % width;
+      int y = minimapDirtyTexels[k] / width;
+      xMin = x < xMin ? x : xMin;
+      yMin = y < yMin ? y : yMin;
+      xMax = x > xMax ? x : xMax;
+      yMax = y > yMax ? y : yMax;
+    }
+    int boxWidth = xMax - xMin + 1;
+    int boxHeight = yMax - yMin + 1;
+    // Whole rows are contiguous in the image already
+    Color *box = &pixels[yMin * width];
+    if (boxWidth < width) {
+      box = minimapUploadBox;
+      for (int y = 0; y < boxHeight; y++) {
+        memcpy(&box[y * boxWidth], &pixels[(yMin + y) * width + xMin],
+               boxWidth * sizeof(Color));
+      }
+    }
+    UpdateTextureRec(minimapTexture,
+                     (Rectangle){xMin, yMin, boxWidth, boxHeight}, box);
+  }
+  minimapDirtyTexelsSize = 0;
+}
+
+// Applies the changes of a new snapshot
+static void UpdateMinimap(RenderSnapshot *snapshot) {
+  if (isMinimapStale || snapshot->hasLostChanges) {
+    BuildMinimap(snapshot);
+    return;
+  }
+  if (snapshot->tick == minimapTick)
+    return;
+  minimapTick = snapshot->tick;
+  // Before the entities, while no texel is dirty, so the fog ones fit
+  if (snapshot->visionVersion != minimapVisionVersion)
+    UpdateMinimapFog(snapshot);
+  ReserveMinimapEntities(snapshot->entitiesSize);
+  for (int k = 0; k < snapshot->changedEntitiesSize; k++) {
+    int index = snapshot->changedEntities[k];
+    ReserveMinimapEntities(index + 1); // May be gone already
+    UpdateMinimapEntity(index, index < snapshot->entitiesSize
+                                   ? &snapshot->entities[index]
+                                   : NULL);
+    if (minimapDirtyTexelsSize + 2 > mapSize.x * mapSize.y * 2)
+      UploadMinimapDirtyTexels();
+  }
+  UploadMinimapDirtyTexels();
+}
+
+static void DrawMinimap(void) {
+  if (!minimapTexture.id)
+    return;
+  Vector2 corners[4] = {TileToMinimap((Vector2){0, 0}),
+                        TileToMinimap((Vector2){0, mapSize.y}),
+                        TileToMinimap((Vector2){mapSize.x, mapSize.y}),
+                        TileToMinimap((Vector2){mapSize.x, 0})};
+  Vector2 texcoords[4] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+  rlSetTexture(minimapTexture.id);
+  rlBegin(RL_QUADS);
+  rlColor4ub(255, 255, 255, 255);
+  for (int c = 0; c < 4; c++) {
+    rlTexCoord2f(texcoords[c].x, texcoords[c].y);
+    rlVertex2f(corners[c].x, corners[c].y);
+  }
+  rlEnd();
+  rlSetTexture(0);
+
+  // Outline of the view
+  Vector2 screenCorners[4] = {{0, 0},
+                              {GetScreenWidth(), 0},
+                              {GetScreenWidth(), GetScreenHeight()},
+                              {0, GetScreenHeight()}};
+  Vector2 view[4];
+  for (int c = 0; c < 4; c++) {
+    view[c] = TileToMinimap(
+        WorldToTile(GetScreenToWorld2D(screenCorners[c], camera)));
+  }
+  for (int c = 0; c < 4; c++) {
+    DrawLineV(view[c], view[(c + 1) % 4], WHITE);
+  }
+}
+
+// Moves the camera while the minimap is clicked. Returns true when the mouse
+// is over the minimap, so clicks do not go through to the world.
+static bool CheckMinimap(Camera2D *camera) {
+  if (!minimapTexture.id)
+    return false;
+  Vector2 tile = MinimapToTile(GetMousePosition());
+  if (tile.x < 0 || tile.y < 0 || tile.x >= mapSize.x || tile.y >= mapSize.y)
+    return false;
+  if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+    camera->target =
+        (Vector2){ToXIso(tile.x, tile.y) + grassTexture.texture.width / 2.0f,
+                  ToYIso(tile.x, tile.y)};
+  }
+  return true;
+}
+
+static void FreeMinimap(void) {
+  if (minimapTexture.id) {
+    UnloadTexture(minimapTexture);
+    UnloadImage(minimapImage);
+  }
+  minimapTexture = (Texture2D){0};
+  minimapImage = (Image){0};
+  free(minimapCounts);
+  minimapCounts = NULL;
+  free(minimapDirtyTexels);
+  minimapDirtyTexels = NULL;
+  free(minimapUploadBox);
+  minimapUploadBox = NULL;
+  free(minimapVisibleTiles);
+  minimapVisibleTiles = NULL;
+  free(minimapExploredTiles);
+  minimapExploredTiles = NULL;
+  free(minimapEntityTexels);
+  minimapEntityTexels = NULL;
+  minimapEntityTexelsCapacity = 0;
+  isMinimapStale = true;
+}
+
+// SPATIAL QUERIES
+//
+// Every entity is in entitiesGrid by its ground point, kept up to date as
+// entities are added, moved and removed, so the simulation finds the ones
+// around a point without a scan. A hitbox reaches at most entitiesReach from
+// its ground point: queries for hitboxes extend their area by that much, then
+// check the hitboxes of what they found.
+
+// Middle of the bottom of the hitbox, where an entity stands
+static Vector2 GetEntityGroundPoint(Entity *entity) {
+  Rectangle hitbox = GetEntityHitbox(entity);
+  return (Vector2){hitbox.x + hitbox.width / 2.0f, hitbox.y + hitbox.height};
+}
+
+// Bit of the type of the entity among those of its team, its mask in
+// entitiesGrid
+static unsigned int GetEntityMask(Entity *entity) {
+  return 1u << (entity->team * ENTITY_TYPES_COUNT + entity->type);
+}
+
+// Mask of the types of typesMask, of the entities of team
+static unsigned int GetTeamMask(unsigned int typesMask, Team team) {
+  return typesMask << (team * ENTITY_TYPES_COUNT);
+}
+
+static void AddToEntitiesGrid(int index) {
+  Entity *entity = &entities[index];
+  Vector2 ground = GetEntityGroundPoint(entity);
+  AddSpatialItem(&entitiesGrid, index, ground.x, ground.y,
+                 GetEntityMask(entity));
+}
+
+// Covers the whole map
+static void InitEntitiesGrid(void) {
+  float left = ToXIso(0, mapSize.y - 1);
+  float right = ToXIso(mapSize.x - 1, 0) + grassTexture.texture.width;
+  float bottom = ToYIso(mapSize.x - 1, mapSize.y - 1) +
+                 grassTexture.texture.height;
+  entitiesGrid = CreateSpatialGrid(left, 0.0f, right - left, bottom,
+                                   ENTITIES_GRID_CELL_SIZE);
+  entitiesReach = (Vector2){0};
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    Rectangle hitbox = archetypes[type].relativeHitbox;
+    entitiesReach.x = fmaxf(entitiesReach.x, hitbox.width / 2.0f);
+    entitiesReach.y = fmaxf(entitiesReach.y, hitbox.height);
+  }
+  for (int i = 0; i < entitiesSize; i++) {
+    AddToEntitiesGrid(i);
+  }
+}
+
+// Before the entity position is changed
+static void MoveInEntitiesGrid(int index, Vector2 position) {
+  Entity *entity = &entities[index];
+  Vector2 ground = GetEntityGroundPoint(entity);
+  // Computed the same way, or the rounding could differ from the point
+  // looked up when the entity is next moved or removed
+  Entity moved = *entity;
+  moved.position = position;
+  Vector2 newGround = GetEntityGroundPoint(&moved);
+  MoveSpatialItem(&entitiesGrid, index, ground.x, ground.y, newGround.x,
+                  newGround.y);
+}
+
+// The entity at index is removed and the one at movedIndex takes its place
+static void RemoveFromEntitiesGrid(int index, int movedIndex) {
+  Vector2 ground = GetEntityGroundPoint(&entities[index]);
+  RemoveSpatialItem(&entitiesGrid, index, ground.x, ground.y);
+  if (movedIndex != index) {
+    ground = GetEntityGroundPoint(&entities[movedIndex]);
+    RenameSpatialItem(&entitiesGrid, movedIndex, index, ground.x, ground.y);
+  }
+}
+
+// Where the ground points of the entities whose hitbox may overlap area are
+static Rectangle GetAreaAround(Rectangle area) {
+  // A pixel more on every side for the rounding of the ground points
+  return (Rectangle){area.x - entitiesReach.x - 1.0f, area.y - 1.0f,
+                     area.width + 2.0f * entitiesReach.x + 2.0f,
+                     area.height + entitiesReach.y + 2.0f};
+}
+
+// Entities matching mask whose hitbox may overlap area, to check. Returns
+// their count, of which the first capacity are written to results.
+static int QueryEntitiesAround(Rectangle area, unsigned int mask,
+                               SpatialItem *results, int capacity) {
+  Rectangle around = GetAreaAround(area);
+  return QuerySpatialRectangle(&entitiesGrid, around.x, around.y,
+                               around.width, around.height, mask, results,
+                               capacity);
+}
+
+// Same entities, read in chunks with NextSpatialItems for the callers that
+// must check all of them
+static SpatialCursor StartEntitiesAround(Rectangle area, unsigned int mask) {
+  Rectangle around = GetAreaAround(area);
+  return StartSpatialRectangle(&entitiesGrid, around.x, around.y,
+                               around.width, around.height, mask);
+}
+
+// Lowest index of the entities matching mask whose hitbox contains position,
+// -1 when there is none
+static int FindEntityAt(Vector2 position, unsigned int mask) {
+  SpatialItem around[NEARBY_ENTITIES_MAX];
+  SpatialCursor cursor =
+      StartEntitiesAround((Rectangle){position.x, position.y, 0, 0}, mask);
+  int found = -1;
+  int count;
+  while ((count = NextSpatialItems(&entitiesGrid, &cursor, around,
+                                   NEARBY_ENTITIES_MAX)) > 0) {
+    for (int k = 0; k < count; k++) {
+      int i = around[k].id;
+      Entity *entity = &entities[i];
+      if ((mask & GetEntityMask(entity)) && (found < 0 || i < found) &&
+          CheckCollisionPointRec(position, GetEntityHitbox(entity)))
+        found = i;
+    }
+  }
+  return found;
+}
+
+// ENTITY IDS
+//
+// Removing an entity moves the last one in its place, so the systems refer
+// to the entities they do not own, like a target, by id rather than index.
+// An id is a slot of entityIdSlots, which follows its entity around, plus the
+// generation of that slot, bumped when the entity is removed: the id then
+// resolves to -1, even once the slot is reused. Nothing has to be fixed up in
+// the referrers.
+
+static int CreateEntityId(int index) {
+  int slot = freeEntityIdSlot;
+  if (slot >= 0) {
+    freeEntityIdSlot = entityIdSlots[slot].index;
+  } else {
+    if (entityIdSlotsSize == entityIdSlotsCapacity) {
+      entityIdSlotsCapacity =
+          entityIdSlotsCapacity ? entityIdSlotsCapacity * 2 : 1024;
+      entityIdSlots = realloc(entityIdSlots,
+                              entityIdSlotsCapacity * sizeof(EntityIdSlot));
+    }
+    slot = entityIdSlotsSize++;
+    entityIdSlots[slot].id = slot;
+  }
+  entityIdSlots[slot].index = index;
+  return entityIdSlots[slot].id;
+}
+
+static void RemoveEntityId(int id) {
+  int slot = id & ENTITY_ID_SLOT_MASK;
+  entityIdSlots[slot].id =
+      (id + ENTITY_ID_SLOT_MASK + 1) & ENTITY_ID_MASK; // Next generation
+  entityIdSlots[slot].index = freeEntityIdSlot;
+  freeEntityIdSlot = slot;
+}
+
+// Index of the entity with id, -1 once it was removed
+static int GetEntityIndex(int id) {
+  if (id < 0 || (id & ENTITY_ID_SLOT_MASK) >= entityIdSlotsSize)
+    return -1;
+  EntityIdSlot *slot = &entityIdSlots[id & ENTITY_ID_SLOT_MASK];
+  return slot->id == id ? slot->index : -1;
+}
+
+static void FreeEntityIds(void) {
+  free(entityIdSlots);
+  entityIdSlots = NULL;
+  entityIdSlotsSize = 0;
+  entityIdSlotsCapacity = 0;
+  freeEntityIdSlot = -1;
+}
+
+// Once the entities of a new world are in place
+static void InitEntityIds(void) {
+  FreeEntityIds();
+  for (int i = 0; i < entitiesSize; i++) {
+    entities[i].id = CreateEntityId(i);
+  }
+}
+
+// GATHERING
+//
+// Villagers sent to a resource harvest it, carry what they got to the
+// nearest drop-off and come back, then go to the nearest resource of the same
+// kind once theirs is depleted. Finding those takes a nearest query of
+// entitiesGrid, not a scan of the entities, and only the gatherers array is
+// visited every tick. Gatherers refer to their resource and drop-off by id,
+// and Entity.gatherer leads to the gatherer of a villager, so removing an
+// entity never scans them.
+
+static unsigned int GetResourceTypesMask(ResourceType resource) {
+  unsigned int mask = 0;
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    if (archetypes[type].resource == resource)
+      mask |= 1u << type;
+  }
+  return mask;
+}
+
+static unsigned int GetGatherableTypesMask(void) {
+  unsigned int mask = 0;
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    if (archetypes[type].resource != RESOURCE_NONE)
+      mask |= 1u << type;
+  }
+  return mask;
+}
+
+static unsigned int GetDropOffTypesMask(void) {
+  unsigned int mask = 0;
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    if (archetypes[type].isDropOff)
+      mask |= 1u << type;
+  }
+  return mask;
+}
+
+static void FreeGathering(void) {
+  free(gatherers);
+  gatherers = NULL;
+  gatherersSize = 0;
+  gatherersCapacity = 0;
+}
+
+// The last gatherer takes its place
+static void RemoveGatherer(int slot) {
+  entities[gatherers[slot].entity].gatherer = -1;
+  gatherers[slot] = gatherers[--gatherersSize];
+  if (slot < gatherersSize)
+    entities[gatherers[slot].entity].gatherer = slot;
+}
+
+// The entity at index is removed and the one at movedIndex takes its place
+static void UpdateGatherersOnRemoval(int index, int movedIndex) {
+  if (entities[index].gatherer >= 0)
+    RemoveGatherer(entities[index].gatherer);
+  if (movedIndex != index && entities[movedIndex].gatherer >= 0)
+    gatherers[entities[movedIndex].gatherer].entity = index;
+}
+
+static Gatherer *FindGatherer(int entityIndex) {
+  int slot = entities[entityIndex].gatherer;
+  return slot >= 0 ? &gatherers[slot] : NULL;
+}
+
+// Where an entity stands to gather from target: below its hitbox
+static Vector2 GetGatherPosition(Entity *entity, Entity *target) {
+  Rectangle relativeHitbox = archetypes[entity->type].relativeHitbox;
+  Rectangle hitbox = GetEntityHitbox(target);
+  return (Vector2){hitbox.x + hitbox.width / 2.0f - relativeHitbox.x -
+                       relativeHitbox.width / 2.0f,
+                   hitbox.y + hitbox.height + 1.0f - relativeHitbox.y};
+}
+
+static bool IsInGatherRange(Entity *entity, Entity *target) {
+  Rectangle reach = GetEntityHitbox(entity);
+  reach.x -= GATHER_RANGE;
+  reach.y -= GATHER_RANGE;
+  reach.width += 2.0f * GATHER_RANGE;
+  reach.height += 2.0f * GATHER_RANGE;
+  return CheckCollisionRecs(reach, GetEntityHitbox(target));
+}
+
+static void StartGathering(int entityIndex, int resourceIndex) {
+  Gatherer *gatherer = FindGatherer(entityIndex);
+  if (!gatherer) {
+    if (gatherersSize == gatherersCapacity) {
+      gatherersCapacity = gatherersCapacity ? gatherersCapacity * 2 : 64;
+      gatherers = realloc(gatherers, gatherersCapacity * sizeof(Gatherer));
+    }
+    entities[entityIndex].gatherer = gatherersSize;
+    gatherer = &gatherers[gatherersSize++];
+    *gatherer = (Gatherer){.entity = entityIndex};
+  }
+  ResourceType resource = archetypes[entities[resourceIndex].type].resource;
+  if (gatherer->resource != resource)
+    gatherer->carried = 0; // Dropped
+  gatherer->resourceId = entities[resourceIndex].id;
+  gatherer->dropOffId = -1;
+  gatherer->resource = resource;
+  gatherer->state = GATHER_GOING;
+  Entity *entity = &entities[entityIndex];
+  entity->targetPosition =
+      GetGatherPosition(entity, &entities[resourceIndex]);
+}
+
+static void StopGathering(int entityIndex) {
+  if (entities[entityIndex].gatherer >= 0)
+    RemoveGatherer(entities[entityIndex].gatherer);
+}
+
+static void AddToResources(ResourceType resource, int amount) {
+  switch (resource) {
+  case RESOURCE_WOOD:
+    resources.wood += amount;
+    break;
+  case RESOURCE_STONE:
+    resources.stone += amount;
+    break;
+  case RESOURCE_GOLD:
+    resources.gold += amount;
+    break;
+  case RESOURCE_FOOD:
+    resources.food += amount;
+    break;
+  default:
+    break;
+  }
+}
+
+// Returns false once the gatherer has nothing left to do
+static bool UpdateGatherer(Gatherer *gatherer) {
+  bool isReturning = gatherer->state == GATHER_RETURNING;
+  int *targetId = isReturning ? &gatherer->dropOffId : &gatherer->resourceId;
+  int target = GetEntityIndex(*targetId);
+  Entity *entity = &entities[gatherer->entity];
+  if (target < 0) {
+    Vector2 ground = GetEntityGroundPoint(entity);
+    unsigned int mask = isReturning ? GetDropOffTypesMask()
+                                    : GetResourceTypesMask(gatherer->resource);
+    target = FindNearestSpatialItem(&entitiesGrid, ground.x, ground.y, mask);
+    if (target < 0) {
+      entity->targetPosition = entity->position;
+      return false;
+    }
+    *targetId = entities[target].id;
+    if (!isReturning)
+      gatherer->state = GATHER_GOING;
+    entity->targetPosition = GetGatherPosition(entity, &entities[target]);
+  }
+  Entity *targetEntity = &entities[target];
+  switch (gatherer->state) {
+  case GATHER_GOING:
+    if (IsInGatherRange(entity, targetEntity)) {
+      gatherer->state = GATHER_HARVESTING;
+      gatherer->harvestTicks = GATHER_TICKS;
+      entity->targetPosition = entity->position;
+    }
+    break;
+  case GATHER_HARVESTING:
+    if (--gatherer->harvestTicks > 0)
+      break;
+    gatherer->harvestTicks = GATHER_TICKS;
+    gatherer->carried++;
+    targetEntity->hp--;
+    if (targetEntity->hp > 0)
+      UpdateEntityHash(target);
+    else
+      RemoveFromEntities(target); // Its gatherers look for another one
+    if (gatherer->carried >= GATHER_CAPACITY) {
+      gatherer->state = GATHER_RETURNING;
+      gatherer->dropOffId = -1;
+    }
+    break;
+  case GATHER_RETURNING:
+    if (!IsInGatherRange(entity, targetEntity))
+      break;
+    AddToResources(gatherer->resource, gatherer->carried);
+    gatherer->carried = 0;
+    gatherer->state = GATHER_GOING;
+    int resource = GetEntityIndex(gatherer->resourceId);
+    if (resource >= 0)
+      entity->targetPosition =
+          GetGatherPosition(entity, &entities[resource]);
+    break;
+  }
+  return true;
+}
+
+// Before the movements, which take the gatherers where they go
+static void ProcessGathering(void) {
+  for (int i = 0; i < gatherersSize;) {
+    if (UpdateGatherer(&gatherers[i]))
+      i++;
+    else
+      RemoveGatherer(i);
+  }
+}
+
+// PRODUCTION
+//
+// Buildings train units one after the other from a queue, paid for and
+// checked against the population cap when they are queued, so the check is
+// O(1) with the counters of CountPopulation. Only the buildings with units
+// queued are in productionQueues: the timers of all of them are advanced in
+// one pass over that array every tick, and Entity.productionQueue leads to the
+// queue of a building. Trained units appear in the first free spot below
+// their building, found with queries of entitiesGrid.
+
+static void FreeProduction(void) {
+  free(productionQueues);
+  productionQueues = NULL;
+  productionQueuesSize = 0;
+  productionQueuesCapacity = 0;
+}
+
+static bool CanAfford(struct Resources *cost, struct Resources *available) {
+  return available->wood >= cost->wood && available->stone >= cost->stone &&
+         available->gold >= cost->gold && available->food >= cost->food;
+}
+
+// count is 1 to pay, -1 to refund
+static void PayResources(struct Resources *cost, int count) {
+  resources.wood -= count * cost->wood;
+  resources.stone -= count * cost->stone;
+  resources.gold -= count * cost->gold;
+  resources.food -= count * cost->food;
+}
+
+static unsigned int GetProducerTypesMask(void) {
+  unsigned int mask = 0;
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    if (archetypes[type].trainsMask)
+      mask |= 1u << type;
+  }
+  return mask;
+}
+
+// Refunds the units in the queue
+static void CancelProduction(ProductionQueue *queue) {
+  for (int k = 0; k < queue->count; k++) {
+    EntityType unit = queue->units[(queue->first + k) % PRODUCTION_QUEUE_SIZE];
+    PayResources(&archetypes[unit].cost, -1);
+  }
+  queuedPopulation -= queue->count;
+  queue->count = 0;
+}
+
+// The last queue takes its place
+static void RemoveProductionQueue(int slot) {
+  entities[productionQueues[slot].building].productionQueue = -1;
+  productionQueues[slot] = productionQueues[--productionQueuesSize];
+  if (slot < productionQueuesSize)
+    entities[productionQueues[slot].building].productionQueue = slot;
+}
+
+// The entity at index is removed and the one at movedIndex takes its place
+static void UpdateProductionOnRemoval(int index, int movedIndex) {
+  int slot = entities[index].productionQueue;
+  if (slot >= 0) {
+    CancelProduction(&productionQueues[slot]);
+    RemoveProductionQueue(slot);
+  }
+  slot = entities[movedIndex].productionQueue;
+  if (movedIndex != index && slot >= 0)
+    productionQueues[slot].building = index;
+}
+
+static ProductionQueue *FindProductionQueue(int building) {
+  int slot = entities[building].productionQueue;
+  return slot >= 0 ? &productionQueues[slot] : NULL;
+}
+
+// Queues a unit at building. Fails when the building does not train it, the
+// population would exceed its cap, the unit cannot be paid for or the queue
+// is full.
+static bool TryTrain(int building, EntityType unit) {
+  Archetype *archetype = &archetypes[unit];
+  if (!(archetypes[entities[building].type].trainsMask & (1u << unit)))
+    return false;
+  // Queued units count, they will need the room once trained
+  if (GetPopulation() + queuedPopulation >= GetMaxPopulation())
+    return false;
+  if (!CanAfford(&archetype->cost, &resources))
+    return false;
+  ProductionQueue *queue = FindProductionQueue(building);
+  if (queue && queue->count == PRODUCTION_QUEUE_SIZE)
+    return false;
+  if (!queue) {
+    if (productionQueuesSize == productionQueuesCapacity) {
+      productionQueuesCapacity =
+          productionQueuesCapacity ? productionQueuesCapacity * 2 : 8;
+      productionQueues =
+          realloc(productionQueues,
+                  productionQueuesCapacity * sizeof(ProductionQueue));
+    }
+    entities[building].productionQueue = productionQueuesSize;
+    queue = &productionQueues[productionQueuesSize++];
+    *queue = (ProductionQueue){.building = building,
+                               .ticksLeft = archetype->trainTicks};
+  }
+  queue->units[(queue->first + queue->count++) % PRODUCTION_QUEUE_SIZE] = unit;
+  PayResources(&archetype->cost, 1);
+  queuedPopulation++;
+  return true;
+}
+
+// Whether area overlaps no hitbox
+static bool IsAreaFree(Rectangle area) {
+  SpatialItem around[NEARBY_ENTITIES_MAX];
+  SpatialCursor cursor = StartEntitiesAround(area, ALL_ENTITY_TYPES_MASK);
+  int count;
+  while ((count = NextSpatialItems(&entitiesGrid, &cursor, around,
+                                   NEARBY_ENTITIES_MAX)) > 0) {
+    for (int k = 0; k < count; k++) {
+      if (CheckCollisionRecs(area, GetEntityHitbox(&entities[around[k].id])))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Position of a unit trained at building, in the first free spot of the rows
+// below it, from the middle outward
+static bool FindSpawnPosition(int building, EntityType unit,
+                              Vector2 *position) {
+  Rectangle buildingHitbox = GetEntityHitbox(&entities[building]);
+  Rectangle unitHitbox = archetypes[unit].relativeHitbox;
+  float stepX = unitHitbox.width + SPAWN_SPACING;
+  float stepY = unitHitbox.height + SPAWN_SPACING;
+  int columns = buildingHitbox.width / 2.0f / stepX + SPAWN_EXTRA_COLUMNS;
+  float middle = buildingHitbox.x + buildingHitbox.width / 2.0f;
+  for (int row = 0; row < SPAWN_ROWS; row++) {
+    Rectangle area = {.y = buildingHitbox.y + buildingHitbox.height +
+                           SPAWN_SPACING + row * stepY,
+                      .width = unitHitbox.width,
+                      .height = unitHitbox.height};
+    for (int k = 0; k <= 2 * columns; k++) {
+      // 0, 1, -1, 2, -2...
+      int column = k % 2 ? (k + 1) / 2 : -k / 2;
+      area.x = middle - unitHitbox.width / 2.0f + column * stepX;
+      if (IsAreaFree(area)) {
+        *position = (Vector2){area.x - unitHitbox.x, area.y - unitHitbox.y};
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Trains the first unit of the queue, false when there is no room for it
+static bool SpawnUnit(ProductionQueue *queue) {
+  EntityType unit = queue->units[queue->first];
+  Vector2 position;
+  if (!FindSpawnPosition(queue->building, unit, &position))
+    return false;
+  AddToEntities(unit, position, entities[queue->building].team);
+  queuedPopulation--;
+  queue->first = (queue->first + 1) % PRODUCTION_QUEUE_SIZE;
+  queue->count--;
+  if (queue->count > 0)
+    queue->ticksLeft = archetypes[queue->units[queue->first]].trainTicks;
+  return true;
+}
+
+static void ProcessProduction(void) {
+  int trainedCount = 0;
+  for (int i = 0; i < productionQueuesSize; i++) {
+    if (--productionQueues[i].ticksLeft <= 0)
+      trainedCount++;
+  }
+  if (trainedCount == 0)
+    return;
+  ReserveEntities(entitiesSize + trainedCount);
+  for (int i = 0; i < productionQueuesSize;) {
+    ProductionQueue *queue = &productionQueues[i];
+    if (queue->ticksLeft <= 0 && !SpawnUnit(queue))
+      queue->ticksLeft = 1; // Tries again next tick
+    if (queue->count > 0)
+      i++;
+    else
+      RemoveProductionQueue(i);
+  }
+}
+
+// VISION
+//
+// Fog of war. Every tile counts the viewers that see it: it is visible while
+// that count is not 0, and stays explored once seen. Both states are kept as
+// bits, copied to the renderer when they change. A viewer sees a circle of
+// tiles around its own, as spans of rows precomputed for every radius in
+// sightSpans. Viewers are visited every tick, but only the ones that crossed
+// into another tile update the counts, and only those of the ring between
+// their old and new circles. Entity.viewer leads to the viewer of an entity.
+
+static void FreeVision(void) {
+  free(visionCounts);
+  free(visibleTiles);
+  free(exploredTiles);
+  free(viewers);
+  visionCounts = NULL;
+  visibleTiles = NULL;
+  exploredTiles = NULL;
+  tilesWordsCount = 0;
+  viewers = NULL;
+  viewersSize = 0;
+  viewersCapacity = 0;
+}
+
+static bool IsTileBitSet(uint64_t *bits, int tile) {
+  return (bits[tile >> 6] >> (tile & 63)) & 1;
+}
+
+static Fog GetTileFog(uint64_t *visible, uint64_t *explored, int tile) {
+  if (IsTileBitSet(visible, tile))
+    return FOG_NONE;
+  return IsTileBitSet(explored, tile) ? FOG_EXPLORED : FOG_UNEXPLORED;
+}
+
+// Tile of the ground point of the entity, the nearest one of the map when
+// out of it
+static int GetEntityTile(Entity *entity, int *i, int *j) {
+  Vector2 tile = WorldToTile(GetEntityGroundPoint(entity));
+  int width = mapSize.x, height = mapSize.y;
+  *i = tile.x < 0.0f ? 0 : tile.x < width ? (int)tile.x : width - 1;
+  *j = tile.y < 0.0f ? 0 : tile.y < height ? (int)tile.y : height - 1;
+  return *j * width + *i;
+}
+
+static Fog GetEntityFog(Entity *entity) {
+  int i, j;
+  return GetTileFog(visibleTiles, exploredTiles, GetEntityTile(entity, &i, &j));
+}
+
+// Adds count, 1 or -1, to the viewers of the tiles start to end of row j
+static void AddRowSight(int j, int start, int end, int count) {
+  int width = mapSize.x;
+  start = start > 0 ? start : 0;
+  end = end < width - 1 ? end : width - 1;
+  for (int i = start; i <= end; i++) {
+    int tile = j * width + i;
+    uint64_t bit = (uint64_t)1 << (tile & 63);
+    visionCounts[tile] += count;
+    if (visionCounts[tile] == 0) {
+      visibleTiles[tile >> 6] &= ~bit;
+      visionVersion++;
+    } else if (visionCounts[tile] == 1 && count > 0) {
+      visibleTiles[tile >> 6] |= bit;
+      exploredTiles[tile >> 6] |= bit;
+      visionVersion++;
+    }
+  }
+}
+
+// Adds count to the viewers of the tiles viewer sees, but not of those
+// except sees when it is not NULL
+static void AddSight(Viewer *viewer, Viewer *except, int count) {
+  int radius = viewer->radius;
+  for (int dy = -radius; dy <= radius; dy++) {
+    int j = viewer->tileY + dy;
+    if (j < 0 || j >= mapSize.y)
+      continue;
+    int span = sightSpans[radius][abs(dy)];
+    int start = viewer->tileX - span, end = viewer->tileX + span;
+    int exceptDy = except ? j - except->tileY : 0;
+    if (!except || abs(exceptDy) > except->radius) {
+      AddRowSight(j, start, end, count);
+      continue;
+    }
+    int exceptSpan = sightSpans[except->radius][abs(exceptDy)];
+    int exceptStart = except->tileX - exceptSpan;
+    int exceptEnd = except->tileX + exceptSpan;
+    AddRowSight(j, start, end < exceptStart - 1 ? end : exceptStart - 1,
+                count);
+    AddRowSight(j, start > exceptEnd + 1 ? start : exceptEnd + 1, end, count);
+  }
+}
+
+// Where the entity at index sees from now
+static Viewer GetViewer(int index) {
+  Viewer viewer = {.entity = index,
+                   .radius = archetypes[entities[index].type].sightRadius};
+  GetEntityTile(&entities[index], &viewer.tileX, &viewer.tileY);
+  return viewer;
+}
+
+// Only the player's entities reveal tiles
+static void AddToViewers(int index) {
+  Entity *entity = &entities[index];
+  if (entity->team != TEAM_PLAYER ||
+      archetypes[entity->type].sightRadius <= 0)
+    return;
+  if (viewersSize == viewersCapacity) {
+    viewersCapacity = viewersCapacity ? viewersCapacity * 2 : 16;
+    viewers = realloc(viewers, viewersCapacity * sizeof(Viewer));
+  }
+  entity->viewer = viewersSize;
+  viewers[viewersSize] = GetViewer(index);
+  AddSight(&viewers[viewersSize++], NULL, 1);
+}
+
+// The entity at index is removed and the one at movedIndex takes its place
+static void UpdateVisionOnRemoval(int index, int movedIndex) {
+  int slot = entities[index].viewer;
+  if (slot >= 0) {
+    AddSight(&viewers[slot], NULL, -1);
+    // The last viewer takes its place
+    viewers[slot] = viewers[--viewersSize];
+    if (slot < viewersSize)
+      entities[viewers[slot].entity].viewer = slot;
+  }
+  slot = entities[movedIndex].viewer;
+  if (movedIndex != index && slot >= 0)
+    viewers[slot].entity = index;
+}
+
+// Once the entities of a new world are in place
+static void InitVision(void) {
+  for (int radius = 0; radius <= SIGHT_RADIUS_MAX; radius++) {
+    // Half a tile more for rounder circles
+    float r = radius + 0.5f;
+    for (int dy = 0; dy <= radius; dy++) {
+      sightSpans[radius][dy] = sqrtf(r * r - dy * dy);
+    }
+  }
+  FreeVision();
+  int tilesCount = mapSize.x * mapSize.y;
+  tilesWordsCount = (tilesCount + 63) / 64;
+  visionCounts = calloc(tilesCount, sizeof(unsigned short));
+  visibleTiles = calloc(tilesWordsCount, sizeof(uint64_t));
+  exploredTiles = calloc(tilesWordsCount, sizeof(uint64_t));
+  visionVersion++;
+  for (int i = 0; i < entitiesSize; i++) {
+    AddToViewers(i);
+  }
+}
+
+// After the movements
+static void ProcessVision(void) {
+  for (int i = 0; i < viewersSize; i++) {
+    Viewer *viewer = &viewers[i];
+    Viewer moved = GetViewer(viewer->entity);
+    if (moved.tileX == viewer->tileX && moved.tileY == viewer->tileY)
+      continue;
+    AddSight(&moved, viewer, 1);
+    AddSight(viewer, &moved, -1);
+    *viewer = moved;
+  }
+}
+
+// COMBAT
+//
+// Every entity that can attack is in combatants, the only array visited every
+// tick. Idle ones, or those attack-moving, look for the nearest enemy around
+// them every COMBAT_ACQUIRE_INTERVAL ticks with a nearest query of entitiesGrid
+// bounded to COMBAT_ACQUIRE_RANGE, then chase it until it is in range.
+// Combatants only decide where they go and who they hit, in parallel as they
+// only write their own state and damage slot. Damages are then applied in one
+// pass, so every attack of a tick lands whatever the order, and the entities
+// killed are removed together at the end. Combatants keep their target by id
+// and Entity.combatant leads to the combatant of an entity, so removing one
+// never scans them.
+
+const int COMBAT_GRAIN_SIZE = 256;
+
+static void FreeCombat(void) {
+  free(combatants);
+  free(damages);
+  free(deadEntities);
+  combatants = NULL;
+  damages = NULL;
+  deadEntities = NULL;
+  combatantsSize = 0;
+  combatantsCapacity = 0;
+}
+
+// Units and buildings, not resources
+static unsigned int GetAttackableTypesMask(void) {
+  unsigned int mask = 0;
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    if (archetypes[type].resource == RESOURCE_NONE)
+      mask |= 1u << type;
+  }
+  return mask;
+}
+
+static unsigned int GetEnemiesMask(Team team) {
+  unsigned int mask = 0;
+  for (int other = 0; other < TEAMS_COUNT; other++) {
+    if (other != team)
+      mask |= GetTeamMask(GetAttackableTypesMask(), other);
+  }
+  return mask;
+}
+
+static void AddToCombatants(int index) {
+  if (archetypes[entities[index].type].attackDamage <= 0)
+    return;
+  if (combatantsSize == combatantsCapacity) {
+    combatantsCapacity = combatantsCapacity ? combatantsCapacity * 2 : 16;
+    combatants = realloc(combatants, combatantsCapacity * sizeof(Combatant));
+    damages = realloc(damages, combatantsCapacity * sizeof(Damage));
+    deadEntities = realloc(deadEntities, combatantsCapacity * sizeof(int));
+  }
+  entities[index].combatant = combatantsSize;
+  combatants[combatantsSize++] =
+      (Combatant){.entity = index, .targetId = -1};
+}
+
+// The entity at index is removed and the one at movedIndex takes its place.
+// Those targeting it give up as its id no longer resolves.
+static void UpdateCombatOnRemoval(int index, int movedIndex) {
+  int slot = entities[index].combatant;
+  if (slot >= 0) {
+    // The last combatant takes its place
+    combatants[slot] = combatants[--combatantsSize];
+    if (slot < combatantsSize)
+      entities[combatants[slot].entity].combatant = slot;
+  }
+  slot = entities[movedIndex].combatant;
+  if (movedIndex != index && slot >= 0)
+    combatants[slot].entity = index;
+}
+
+static Combatant *FindCombatant(int entityIndex) {
+  int slot = entities[entityIndex].combatant;
+  return slot >= 0 ? &combatants[slot] : NULL;
+}
+
+// Ordered by the player, the entity attacks target and nothing else
+static void Attack(int entityIndex, int targetIndex) {
+  Combatant *combatant = FindCombatant(entityIndex);
+  if (!combatant)
+    return;
+  combatant->targetId = entities[targetIndex].id;
+  combatant->isAttackMoving = false;
+}
+
+static void AttackMove(int entityIndex, Vector2 destination) {
+  Combatant *combatant = FindCombatant(entityIndex);
+  if (!combatant)
+    return;
+  combatant->targetId = -1;
+  combatant->isAttackMoving = true;
+  combatant->destination = destination;
+  entities[entityIndex].targetPosition = destination;
+}
+
+static void StopFighting(int entityIndex) {
+  Combatant *combatant = FindCombatant(entityIndex);
+  if (!combatant)
+    return;
+  combatant->targetId = -1;
+  combatant->isAttackMoving = false;
+}
+
+static float GetHitboxesDistance(Entity *entity, Entity *target) {
+  Rectangle a = GetEntityHitbox(entity), b = GetEntityHitbox(target);
+  float dx = fmaxf(fmaxf(b.x - (a.x + a.width), a.x - (b.x + b.width)), 0.0f);
+  float dy =
+      fmaxf(fmaxf(b.y - (a.y + a.height), a.y - (b.y + b.height)), 0.0f);
+  return sqrtf(dx * dx + dy * dy);
+}
+
+// Position of entity with its hitbox centered on the point of the target
+// hitbox closest to it, the movements stop it at the border
+static Vector2 GetApproachPosition(Entity *entity, Entity *target) {
+  Rectangle hitbox = GetEntityHitbox(entity);
+  Rectangle targetHitbox = GetEntityHitbox(target);
+  float x = hitbox.x + hitbox.width / 2.0f;
+  float y = hitbox.y + hitbox.height / 2.0f;
+  float closestX =
+      fminf(fmaxf(x, targetHitbox.x), targetHitbox.x + targetHitbox.width);
+  float closestY =
+      fminf(fmaxf(y, targetHitbox.y), targetHitbox.y + targetHitbox.height);
+  return (Vector2){entity->position.x + closestX - x,
+                   entity->position.y + closestY - y};
+}
+
+// Nearest enemy within COMBAT_ACQUIRE_RANGE, -1 when there is none
+static int FindEnemyAround(Entity *entity) {
+  SpatialItem nearest;
+  Vector2 ground = GetEntityGroundPoint(entity);
+  return QuerySpatialNearestInRadius(&entitiesGrid, ground.x, ground.y,
+                                     COMBAT_ACQUIRE_RANGE, 1,
+                                     GetEnemiesMask(entity->team), &nearest)
+             ? nearest.id
+             : -1;
+}
+
+// Where the combatant goes and whom it hits this tick
+static Damage UpdateCombatant(Combatant *combatant, int index) {
+  Entity *entity = &entities[combatant->entity];
+  Archetype *archetype = &archetypes[entity->type];
+  if (combatant->cooldown > 0)
+    combatant->cooldown--;
+  bool isIdle = entity->position.x == entity->targetPosition.x &&
+                entity->position.y == entity->targetPosition.y;
+  int targetIndex = GetEntityIndex(combatant->targetId);
+  if (targetIndex < 0 && (isIdle || combatant->isAttackMoving) &&
+      (simulationTick + index) % COMBAT_ACQUIRE_INTERVAL == 0)
+    targetIndex = FindEnemyAround(entity);
+  if (targetIndex >= 0 && GetHitboxesDistance(entity, &entities[targetIndex]) >
+                              COMBAT_LEASH_RANGE)
+    targetIndex = -1;
+  combatant->targetId = targetIndex >= 0 ? entities[targetIndex].id : -1;
+  if (targetIndex < 0) {
+    // Its target may have been killed or given up
+    if (combatant->isAttackMoving)
+      entity->targetPosition = combatant->destination;
+    return (Damage){-1, 0};
+  }
+  Entity *target = &entities[targetIndex];
+  float distance = GetHitboxesDistance(entity, target);
+  if (distance > archetype->attackRange) {
+    entity->targetPosition = GetApproachPosition(entity, target);
+    return (Damage){-1, 0};
+  }
+  entity->targetPosition = entity->position;
+  if (combatant->cooldown > 0)
+    return (Damage){-1, 0};
+  combatant->cooldown = archetype->attackTicks;
+  return (Damage){targetIndex, archetype->attackDamage};
+}
+
+static void UpdateCombatants(void *data, int start, int end) {
+  for (int i = start; i < end; i++) {
+    damages[i] = UpdateCombatant(&combatants[i], i);
+  }
+}
+
+static int CompareIndicesDescending(const void *a, const void *b) {
+  return *(const int *)b - *(const int *)a;
+}
+
+// Before the movements, which take the combatants to their targets
+static void ProcessCombat(void) {
+  JobGroup group = {0};
+  JobsParallelFor(combatantsSize, COMBAT_GRAIN_SIZE, UpdateCombatants, NULL,
+                  &group);
+  JobsWait(&group);
+  int deadCount = 0;
+  for (int i = 0; i < combatantsSize; i++) {
+    Damage *damage = &damages[i];
+    if (damage->target < 0 || entities[damage->target].hp <= 0)
+      continue;
+    entities[damage->target].hp -= damage->amount;
+    UpdateEntityHash(damage->target);
+    if (entities[damage->target].hp <= 0)
+      deadEntities[deadCount++] = damage->target;
+  }
+  // From the last, so the entities taking the place of the removed ones are
+  // alive
+  qsort(deadEntities, deadCount, sizeof(int), CompareIndicesDescending);
+  for (int i = 0; i < deadCount; i++) {
+    RemoveFromEntities(deadEntities[i]);
+  }
+}
+
+// Once the entities of a new world are in place
+static void InitCombat(void) {
+  combatantsSize = 0;
+  for (int i = 0; i < entitiesSize; i++) {
+    AddToCombatants(i);
+  }
+}
+
+// --battle scenario: size units per team on both sides of the city hall,
+// soldiers in front and archers behind, the enemies attack-moving to the
+// player's army. The trees of the battlefield are removed first.
+static void SpawnBattle(int size) {
+  Rectangle hitbox = archetypes[SOLDIER].relativeHitbox;
+  float stepX = hitbox.width + BATTLE_SPACING;
+  float stepY = hitbox.height + BATTLE_SPACING;
+  int columns = ceilf(sqrtf(size * stepY / stepX));
+  int rows = (size + columns - 1) / columns;
+  // Room for the spots taken by the city hall or left trees
+  Rectangle army = {.width = columns * stepX, .height = 2 * rows * stepY};
+  Vector2 center = {ToXIso(mapSize.x / 2, mapSize.y / 2),
+                    ToYIso(mapSize.x / 2, mapSize.y / 2)};
+  Rectangle field = {center.x - BATTLE_GAP / 2.0f - army.width,
+                     center.y - army.height / 2.0f,
+                     BATTLE_GAP + 2.0f * army.width, army.height};
+  SpatialItem trees[NEARBY_ENTITIES_MAX];
+  int count;
+  while ((count = QueryEntitiesAround(field, GetGatherableTypesMask(), trees,
+                                      NEARBY_ENTITIES_MAX)) > 0) {
+    count = count < NEARBY_ENTITIES_MAX ? count : NEARBY_ENTITIES_MAX;
+    int indices[NEARBY_ENTITIES_MAX];
+    for (int k = 0; k < count; k++) {
+      indices[k] = trees[k].id;
+    }
+    qsort(indices, count, sizeof(int), CompareIndicesDescending);
+    for (int k = 0; k < count; k++) {
+      RemoveFromEntities(indices[k]);
+    }
+  }
+  ReserveEntities(entitiesSize + 2 * size);
+  Vector2 playerArmy = {field.x + army.width / 2.0f, center.y};
+  for (int team = 0; team < TEAMS_COUNT; team++) {
+    // Columns from the front
+    float front = team == TEAM_PLAYER ? field.x + army.width - stepX
+                                      : field.x + field.width - army.width;
+    float columnStep = team == TEAM_PLAYER ? -stepX : stepX;
+    int placed = 0;
+    for (int spot = 0; placed < size && spot < 2 * rows * columns; spot++) {
+      int column = spot % columns, row = spot / columns;
+      Rectangle area = {front + column * columnStep, field.y + row * stepY,
+                        hitbox.width, hitbox.height};
+      if (!IsAreaFree(area))
+        continue;
+      EntityType type = column < columns / 2 ? SOLDIER : ARCHER;
+      AddToEntities(type, (Vector2){area.x - hitbox.x, area.y - hitbox.y},
+                    team);
+      if (team == TEAM_ENEMY)
+        AttackMove(entitiesSize - 1, playerArmy);
+      placed++;
+    }
+  }
+}
+
+// ENTITIES HELPERS
+
+static Entity CreateEntity(EntityType entityType, Vector2 position) {
+  return (Entity){.position = position,
+                  .type = entityType,
+                  .hp = archetypes[entityType].hp,
+                  .isSelected = false,
+                  .targetPosition = position,
+                  .id = -1,
+                  .gatherer = -1,
+                  .productionQueue = -1,
+                  .viewer = -1,
+                  .combatant = -1};
+}
+
+// Room for count entities, so that adding them does not reallocate
+static void ReserveEntities(int count) {
+  if (count < entitiesCapacity)
+    return;
+  while (count >= entitiesCapacity) {
+    entitiesCapacity *= 2;
+  }
+  entities = realloc(entities, entitiesCapacity * sizeof(Entity));
+  entitiesNextPosition =
+      realloc(entitiesNextPosition, entitiesCapacity * sizeof(Vector2));
+  entitiesHash = realloc(entitiesHash, entitiesCapacity * sizeof(uint64_t));
+}
+
+static void AddToEntities(EntityType entityType, Vector2 position, Team team) {
+  ReserveEntities(entitiesSize + 1);
+  entitiesSize += 1;
+  entities[entitiesSize - 1] = CreateEntity(entityType, position);
+  entities[entitiesSize - 1].team = team;
+  entities[entitiesSize - 1].id = CreateEntityId(entitiesSize - 1);
+  entities[entitiesSize - 1].animPhase = GetAnimationPhase(entitiesSize - 1);
+  entitiesHash[entitiesSize - 1] = 0;
+  UpdateEntityHash(entitiesSize - 1);
+  RecordEntityChange(entitiesSize - 1);
+  AddToEntitiesGrid(entitiesSize - 1);
+  AddToViewers(entitiesSize - 1);
+  AddToCombatants(entitiesSize - 1);
+  CountPopulation(&entities[entitiesSize - 1], 1);
+}
+
+// The last entity takes its place, so removing costs the same whatever the
+// number of entities, but the index of that one changes
+static void RemoveFromEntities(int index) {
+  int last = entitiesSize - 1;
+  RemoveFromEntitiesGrid(index, last);
+  UpdateGatherersOnRemoval(index, last);
+  UpdateProductionOnRemoval(index, last);
+  UpdateVisionOnRemoval(index, last);
+  UpdateCombatOnRemoval(index, last);
+  CountPopulation(&entities[index], -1);
+  RemoveEntityId(entities[index].id);
+  entitiesHashSum -= entitiesHash[index];
+  if (index != last) {
+    entities[index] = entities[last];
+    entityIdSlots[entities[index].id & ENTITY_ID_SLOT_MASK].index = index;
+    entitiesHashSum -= entitiesHash[last];
+    entitiesHash[index] = 0;
+    UpdateEntityHash(index);
+    RecordEntityChange(index);
+  }
+  entitiesSize--;
+  RecordEntityChange(last);
+}
+
+// SELECTED ENTITIES HELPERS
+
+static void AddToSelectedEntities(Entity *entity) { entity->isSelected = true; }
+
+// INITS
+
+static void InitCamera(void) {
+  float screenWidth = GetScreenWidth();
+  float screenHeight = GetScreenHeight();
+  float map_center_x = ToXIso(mapSize.x / 2, mapSize.y / 2);
+  float map_center_y = ToYIso(mapSize.x / 2, mapSize.y / 2);
+  camera.target = (Vector2){map_center_x, map_center_y};
+  camera.offset = (Vector2){screenWidth / 2.0f, screenHeight / 2.0f};
+  camera.rotation = 0.0f;
+  camera.zoom = 0.3f;
+}
+
+// TEXTURES LOADING
+//
+// Textures found in the ASSET_PACK_PATH pack, built by tools/asset_packer.c,
+// are uploaded straight from its mapping. The others are decoded from their
+// PNG by jobs, so the menu shows up at once and startup scales with the
+// cores, then uploaded by the main thread, which owns the GL context, as
+// they complete. UpdateTexturesLoading is called every frame until
+// everything is loaded, FinishTexturesLoading waits for the rest.
+
+typedef struct TextureLoad {
+  const char *fileName;
+  GameTexture *gameTexture;
+  const AssetPackEntry *packEntry; // NULL when decoded from the file
+  Image image;                     // Written by the decoding job
+  JobGroup group;
+  bool isDone;
+} TextureLoad;
+
+static TextureLoad textureLoads[] = {
+    {"assets/map/grass.png", &grassTexture},
+    {"assets/primitive/buildings/cityHall.png", &primitiveCityHallTexture},
+    {"assets/primitive/buildings/shelter.png", &primitiveShelterTexture},
+    {"assets/primitive/units/villager.png", &primitiveVillagerTexture},
+    {"assets/resources/tree.png", &treeTexture}};
+
+#define TEXTURE_LOADS_COUNT (int)(sizeof(textureLoads) / sizeof(TextureLoad))
+
+static void DecodeTexture(void *data) {
+  TRACE_BEGIN("DecodeTexture");
+  TextureLoad *load = (TextureLoad *)data;
+  load->image = LoadImage(load->fileName);
+  TRACE_END("DecodeTexture");
+}
+
+// Of the current GL context, name as in the GL extensions string
+static bool HasGlExtension(const char *name) {
+#if defined(PLATFORM_DESKTOP)
+  return glfwExtensionSupported(name);
+#else
+  const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+  size_t length = strlen(name);
+  for (const char *found = extensions ? strstr(extensions, name) : NULL;
+       found; found = strstr(found + length, name)) {
+    // A whole name, not the start of a longer one
+    if ((found == extensions || found[-1] == ' ') &&
+        (found[length] == ' ' || found[length] == '\0'))
+      return true;
+  }
+  return false;
+#endif
+}
+
+// S3TC, which holds the DXT formats, is an extension on every GL version.
+// Browsers expose it under their own names.
+static bool HasDxtSupport(void) {
+  return HasGlExtension("GL_EXT_texture_compression_s3tc") ||
+         HasGlExtension("GL_WEBGL_compressed_texture_s3tc") ||
+         HasGlExtension("GL_WEBKIT_WEBGL_compressed_texture_s3tc");
+}
+
+// Block compressed formats the GPU supports, checked before choosing an entry
+// so uploads do not fail. The asset packer only writes DXT: GPUs without
+// S3TC, most mobile ones, get the RGBA8 entries.
+static bool IsCompressedFormatUsable(int format) {
+  switch (format) {
+  case PIXELFORMAT_COMPRESSED_DXT1_RGB:
+  case PIXELFORMAT_COMPRESSED_DXT1_RGBA:
+  case PIXELFORMAT_COMPRESSED_DXT3_RGBA:
+  case PIXELFORMAT_COMPRESSED_DXT5_RGBA:
+    return isDxtSupported;
+  default:
+    return false;
+  }
+}
+
+// The pack index only bounds the data of an entry by the file, its size,
+// format and mipmaps must fit in that data before it is handed to the GPU
+static bool HasPackEntryPixels(const AssetPackEntry *entry) {
+  if (entry->width <= 0 || entry->height <= 0 ||
+      entry->width > ASSET_PACK_TEXTURE_SIZE_MAX ||
+      entry->height > ASSET_PACK_TEXTURE_SIZE_MAX || entry->mipmaps < 1)
+    return false;
+  int width = entry->width, height = entry->height;
+  long long size = 0;
+  for (int level = 0; level < entry->mipmaps && size <= entry->dataSize;
+       level++) {
+    int levelSize = GetPixelDataSize(width, height, entry->format);
+    if (levelSize <= 0)
+      return false; // Unknown format
+    size += levelSize;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  if (size > entry->dataSize)
+    TraceLog(LOG_WARNING, "Truncated %s in the asset pack", entry->name);
+  return size <= entry->dataSize;
+}
+
+// A compressed entry when the GPU can use one, else the RGBA8 entry. Without
+// a window the RGBA8 entry gives the original size of the image, compressed
+// ones may be padded. NULL when the pack has no usable entry, the PNG file is
+// then decoded.
+static const AssetPackEntry *FindTexturePackEntry(const char *fileName) {
+  for (int i = 0; i < assetPack.entriesCount && !isHeadless; i++) {
+    const AssetPackEntry *entry = &assetPack.entries[i];
+    if (strcmp(entry->name, fileName) == 0 &&
+        IsCompressedFormatUsable(entry->format) && HasPackEntryPixels(entry))
+      return entry;
+  }
+  const AssetPackEntry *entry = FindAssetPackEntryFormat(
+      &assetPack, fileName, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  return entry && HasPackEntryPixels(entry) ? entry : NULL;
+}
+
+// Pixels stay in the pack
+static Image GetPackEntryImage(const AssetPackEntry *entry) {
+  return (Image){.data = (void *)entry->data,
+                 .width = entry->width,
+                 .height = entry->height,
+                 .mipmaps = entry->mipmaps,
+                 .format = entry->format};
+}
+
+// Without a window only the size of the texture is kept
+static void UploadTexture(TextureLoad *load) {
+  TRACE_BEGIN("UploadTexture");
+  const AssetPackEntry *entry = load->packEntry;
+  Image image = entry ? GetPackEntryImage(entry) : load->image;
+  Texture2D texture = {.width = image.width,
+                       .height = image.height,
+                       .mipmaps = 1,
+                       .format = image.format};
+  if (!isHeadless) {
+    texture = LoadTextureFromImage(image);
+    if (!texture.id && entry &&
+        entry->format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+      TraceLog(LOG_WARNING, "Compressed %s rejected, using RGBA8",
+               load->fileName);
+      const AssetPackEntry *rgbaEntry = FindAssetPackEntryFormat(
+          &assetPack, load->fileName, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+      if (rgbaEntry)
+        texture = LoadTextureFromImage(GetPackEntryImage(rgbaEntry));
+    }
+  }
+  if (!entry)
+    UnloadImage(image);
+  texturesMemorySize +=
+      GetPixelDataSize(texture.width, texture.height, texture.format);
+  texturesRgbaMemorySize += GetPixelDataSize(texture.width, texture.height,
+                                             PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  load->gameTexture->texture = texture;
+  load->isDone = true;
+  texturesLoadedCount++;
+  TRACE_END("UploadTexture");
+}
+
+// Frame sizes the draw loops read instead of the textures
+static void InitArchetypeFrames(void) {
+  for (int type = 0; type < ENTITY_TYPES_COUNT; type++) {
+    Archetype *archetype = &archetypes[type];
+    archetype->framesCount = archetype->texture->animFramesNumber;
+    archetype->frameWidth = GetGameTextureWidth(archetype->texture);
+    archetype->frameHeight = archetype->texture->texture.height;
+  }
+}
+
+// Textures built from the loaded ones
+static void InitDerivedTextures(void) {
+  if (!isHeadless) {
+    InitTerrainImpostors();
+  }
+  if (!isHeadless && AreInstancedSpritesSupported()) {
+    treesSprites = LoadInstancedSprites(treeTexture.texture,
+                                        treeTexture.animFramesNumber);
+    useInstancedSprites = true;
+  }
+}
+
+// Uploads the decoded images, returns true once every texture is loaded
+static bool UpdateTexturesLoading(void) {
+  if (texturesLoadedCount == TEXTURE_LOADS_COUNT)
+    return true;
+  // Without workers, one image is decoded here every frame instead
+  bool hasWorkers = JobsGetThreadsCount() > 1;
+  bool canDecodeHere = !hasWorkers;
+  for (int i = 0; i < TEXTURE_LOADS_COUNT; i++) {
+    TextureLoad *load = &textureLoads[i];
+    if (load->isDone)
+      continue;
+    if (!load->packEntry) {
+      if (canDecodeHere) {
+        DecodeTexture(load);
+        canDecodeHere = false;
+      } else if (!hasWorkers || !JobsIsDone(&load->group)) {
+        continue;
+      }
+    }
+    UploadTexture(load);
+  }
+  if (texturesLoadedCount < TEXTURE_LOADS_COUNT)
+    return false;
+  CloseAssetPack(&assetPack); // Everything it held is on the GPU now
+  InitArchetypeFrames();
+  InitDerivedTextures();
+  return true;
+}
+
+static void FinishTexturesLoading(void) {
+  TRACE_BEGIN("FinishTexturesLoading");
+  for (int i = 0; i < TEXTURE_LOADS_COUNT; i++) {
+    JobsWait(&textureLoads[i].group);
+  }
+  while (!UpdateTexturesLoading()) {
+  }
+  TRACE_END("FinishTexturesLoading");
+}
+
+static float GetTexturesLoadingProgress(void) {
+  return (float)texturesLoadedCount / TEXTURE_LOADS_COUNT;
+}
+
+// Starts decoding the textures, they can be used once UpdateTexturesLoading
+// returned true
+static void InitTextures(void) {
+  // MAP TILES
+  grassTexture = (GameTexture){.animFramesNumber = 1};
+
+  // Buildings
+  primitiveCityHallTexture =
+      (GameTexture){.animFramesNumber = 7, .entityType = CITY_HALL};
+  primitiveShelterTexture =
+      (GameTexture){.animFramesNumber = 1, .entityType = SHELTER};
+
+  // Units
+  primitiveVillagerTexture =
+      (GameTexture){.animFramesNumber = 1, .entityType = VILLAGER};
+
+  // Resources
+  treeTexture = (GameTexture){.animFramesNumber = 1, .entityType = TREE};
+
+  texturesLoadedCount = 0;
+  texturesMemorySize = texturesRgbaMemorySize = 0;
+  isDxtSupported = !isHeadless && HasDxtSupport();
+  if (!OpenAssetPack(&assetPack, ASSET_PACK_PATH))
+    TraceLog(LOG_INFO, "No asset pack, decoding the PNG files");
+  for (int i = 0; i < TEXTURE_LOADS_COUNT; i++) {
+    TextureLoad *load = &textureLoads[i];
+    load->isDone = false;
+    load->packEntry = FindTexturePackEntry(load->fileName);
+    atomic_init(&load->group.pending, 0);
+    if (!load->packEntry && JobsGetThreadsCount() > 1)
+      JobsRun(DecodeTexture, load, &load->group);
+  }
+}
+
+static void FreeTextures(void) {
+  FinishTexturesLoading();
+  for (int i = 0; i < TEXTURE_LOADS_COUNT; i++) {
+    UnloadTexture(textureLoads[i].gameTexture->texture);
+  }
+  if (useInstancedSprites) {
+    UnloadInstancedSprites(&treesSprites);
+    useInstancedSprites = false;
+  }
+  FreeTerrainImpostors();
+  FreeMinimap();
+  FreeHud();
+}
+
+// WORLD GENERATION
+//
+// The world is generated by a job as soon as the menu shows, for the seed
+// and map size it currently shows. Generated worlds are double buffered: the
+// latest finished one stays ready while another one is generated after the
+// settings changed. Starting the game takes the ready world over, so the
+// first frame does not wait, unless the settings changed at the last moment.
+//
+// perlin.h has a single state, so only one world is generated at a time.
+
+typedef struct World {
+  int seed;
+  Vector2 mapSize;
+  bool isCacheable; // Loaded from and saved to WORLD_CACHE_PATH
+  enum Tile **map;
+  uint64_t mapHash;
+  Entity *entities;
+  int entitiesSize;
+  int entitiesCapacity;
+  uint64_t *entitiesHash;
+  uint64_t entitiesHashSum;
+  float *treesDensity; // Only while generating
+} World;
+
+// Everything generated worlds depend on besides their seed and size and the
+// code, hashed into the key of cached worlds
+static const struct {
+  float noiseScale;
+  int noiseOctaves;
+  float noisePersistence;
+  float treesThreshold; // Noise above which trees grow
+  float treesDenseNoise; // Noise from which trees are the closest
+  // Spacing between trees, in tree hitboxes, from dense forests to their
+  // edges. At least 1 so hitboxes never overlap.
+  float treesMinSpacing;
+  float treesMaxSpacing;
+  int treesSamplingTries; // Candidates around a tree before giving up on it
+  int clearCenterArea;    // Half size of the area without trees around the
+                          // city hall
+} worldGenerator = {0.1f, 4, 0.5f, 0.25f, 0.5f, 1.25f, 2.5f, 30, 1500};
+
+static World generatedWorlds[2];
+static World *readyWorld = NULL;      // Generated, for the settings it holds
+static World *generatingWorld = NULL; // Owned by the job until it is done
+static JobGroup worldGenerationGroup = {0};
+
+static void GenerateMap(World *world) {
+  world->map = (enum Tile **)malloc(world->mapSize.y * sizeof(enum Tile *));
+  for (int i = 0; i < world->mapSize.y; i++) {
+    world->map[i] = (enum Tile *)malloc(world->mapSize.x * sizeof(enum Tile));
+    for (int j = 0; j < world->mapSize.x; j++) {
+      world->map[i][j] = GRASS;
+    }
+  }
+  world->mapHash = HashMap(world->map, world->mapSize);
+}
+
+static void AddToWorld(World *world, EntityType entityType, Vector2 position) {
+  int index = world->entitiesSize++;
+  if (world->entitiesSize >= world->entitiesCapacity) {
+    world->entitiesCapacity *= 2;
+    world->entities =
+        realloc(world->entities, world->entitiesCapacity * sizeof(Entity));
+    world->entitiesHash = realloc(world->entitiesHash,
+                                  world->entitiesCapacity * sizeof(uint64_t));
+  }
+  Entity *entity = &world->entities[index];
+  *entity = CreateEntity(entityType, position);
+  entity->animPhase = GetAnimationPhase(index);
+  world->entitiesHash[index] = HashEntity(entity, index);
+  world->entitiesHashSum += world->entitiesHash[index];
+}
+
+static void ComputeTreesDensity(void *data, int start, int end) {
+  World *world = (World *)data;
+  int width = world->mapSize.x;
+  for (int j = start; j < end; j++) {
+    for (int i = 0; i < width; i++) {
+      world->treesDensity[j * width + i] =
+          perlin2D_octaves(i * worldGenerator.noiseScale,
+                           j * worldGenerator.noiseScale,
+                           worldGenerator.noiseOctaves,
+                           worldGenerator.noisePersistence);
+    }
+  }
+}
+
+// TREES PLACEMENT
+//
+// Poisson-disc sampling (Bridson) in grid space, where a tree hitbox is a
+// unit square: trees at least 1 apart on either axis cannot overlap. Every
+// tree gets a spacing from the noise where it stands, between
+// treesMinSpacing in dense forests and treesMaxSpacing at their edges, and
+// keeps that distance from its neighbours. The grid cells, a hitbox large,
+// hold at most one tree each, so checking the spacing only looks at the
+// cells around.
+
+typedef struct TreesPlacement {
+  World *world;
+  Vector2 mapCenter;
+  Vector2 origin; // World position of the grid corner
+  Vector2 cellSize;
+  int gridWidth;
+  int gridHeight;
+  int *grid; // Tree in every cell, -1 when empty
+  Vector2 *trees;
+  float *spacings;
+  int treesCount;
+  int *active; // Trees which may still have room around
+  int activeCount;
+  uint64_t randomState;
+} TreesPlacement;
+
+// splitmix64, in [0, 1)
+static float GetPlacementRandom(TreesPlacement *placement) {
+  uint64_t z = (placement->randomState += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return ((z ^ (z >> 31)) >> 40) / (float)(1 << 24);
+}
+
+// Bilinear noise between the tiles corners, -1 outside of the map
+static float SampleTreesDensity(World *world, float i, float j) {
+  int width = world->mapSize.x, height = world->mapSize.y;
+  if (i < 0.0f || j < 0.0f || i > width - 1 || j > height - 1)
+    return -1.0f;
+  int i0 = i < width - 1 ? (int)i : width - 2;
+  int j0 = j < height - 1 ? (int)j : height - 2;
+  float u = i - i0, v = j - j0;
+  float *row = &world->treesDensity[j0 * width + i0];
+  float top = row[0] + (row[1] - row[0]) * u;
+  float bottom = row[width] + (row[width + 1] - row[width]) * u;
+  return top + (bottom - top) * v;
+}
+
+// Spacing a tree at this grid position needs, 0 when none can grow there
+static float GetTreeSpacing(TreesPlacement *placement, Vector2 point) {
+  Vector2 position = {placement->origin.x + point.x * placement->cellSize.x,
+                      placement->origin.y + point.y * placement->cellSize.y};
+  int area = worldGenerator.clearCenterArea;
+  if (fabsf(position.x - placement->mapCenter.x) <= area &&
+      fabsf(position.y - placement->mapCenter.y) <= area)
+    return 0.0f;
+  float halfWidth = grassTexture.texture.width / 2.0f;
+  float quarterHeight = grassTexture.texture.height / 4.0f;
+  float i = (position.x / halfWidth + position.y / quarterHeight) / 2.0f;
+  float j = (position.y / quarterHeight - position.x / halfWidth) / 2.0f;
+  float noise = SampleTreesDensity(placement->world, i, j);
+  if (noise <= worldGenerator.treesThreshold)
+    return 0.0f;
+  float density = (noise - worldGenerator.treesThreshold) /
+                  (worldGenerator.treesDenseNoise -
+                   worldGenerator.treesThreshold);
+  density = density < 1.0f ? density : 1.0f;
+  return worldGenerator.treesMaxSpacing -
+         (worldGenerator.treesMaxSpacing - worldGenerator.treesMinSpacing) *
+             density;
+}
+
+static bool IsTreeSpaced(TreesPlacement *placement, Vector2 point,
+                         float spacing) {
+  int x = point.x, y = point.y;
+  if (point.x < 0.0f || point.y < 0.0f || x >= placement->gridWidth ||
+      y >= placement->gridHeight)
+    return false;
+  int range = ceilf(worldGenerator.treesMaxSpacing);
+  for (int cy = y - range; cy <= y + range; cy++) {
+    for (int cx = x - range; cx <= x + range; cx++) {
+      if (cx < 0 || cy < 0 || cx >= placement->gridWidth ||
+          cy >= placement->gridHeight)
+        continue;
+      int tree = placement->grid[cy * placement->gridWidth + cx];
+      if (tree < 0)
+        continue;
+      float minimum = fmaxf(spacing, placement->spacings[tree]);
+      Vector2 other = placement->trees[tree];
+      if (fabsf(other.x - point.x) < minimum &&
+          fabsf(other.y - point.y) < minimum)
+        return false;
+    }
+  }
+  return true;
+}
+
+static void AddTree(TreesPlacement *placement, Vector2 point, float spacing) {
+  int tree = placement->treesCount++;
+  placement->trees[tree] = point;
+  placement->spacings[tree] = spacing;
+  placement->grid[(int)point.y * placement->gridWidth + (int)point.x] = tree;
+  placement->active[placement->activeCount++] = tree;
+}
+
+// Grows trees around the active ones until none has room left
+static void SpreadTrees(TreesPlacement *placement) {
+  while (placement->activeCount > 0) {
+    int activeIndex = GetPlacementRandom(placement) * placement->activeCount;
+    int tree = placement->active[activeIndex];
+    Vector2 center = placement->trees[tree];
+    float spacing = placement->spacings[tree];
+    bool isAdded = false;
+    for (int k = 0; k < worldGenerator.treesSamplingTries && !isAdded; k++) {
+      float angle = GetPlacementRandom(placement) * 2.0f * PI;
+      float distance = spacing * (1.0f + GetPlacementRandom(placement));
+      Vector2 point = {center.x + cosf(angle) * distance,
+                       center.y + sinf(angle) * distance};
+      float pointSpacing = GetTreeSpacing(placement, point);
+      isAdded =
+          pointSpacing > 0.0f && IsTreeSpaced(placement, point, pointSpacing);
+      if (isAdded)
+        AddTree(placement, point, pointSpacing);
+    }
+    if (!isAdded)
+      placement->active[activeIndex] =
+          placement->active[--placement->activeCount];
+  }
+}
+
+// Every forest is seeded from its first tile in rows order, so each one gets
+// trees however far apart they are
+static void PlaceTrees(World *world, Vector2 mapCenter) {
+  Rectangle hitbox = archetypes[TREE].relativeHitbox;
+  int width = world->mapSize.x, height = world->mapSize.y;
+  TreesPlacement placement = {
+      .world = world,
+      .mapCenter = mapCenter,
+      .origin = {ToXIso(0, height - 1), ToYIso(0, 0)},
+      .cellSize = {hitbox.width, hitbox.height},
+      .randomState = (uint64_t)(uint32_t)world->seed};
+  placement.gridWidth =
+      (ToXIso(width - 1, 0) - placement.origin.x) / hitbox.width + 1;
+  placement.gridHeight =
+      (ToYIso(width - 1, height - 1) - placement.origin.y) / hitbox.height + 1;
+  int cellsCount = placement.gridWidth * placement.gridHeight;
+  placement.grid = (int *)malloc(cellsCount * sizeof(int));
+  memset(placement.grid, -1, cellsCount * sizeof(int));
+  placement.trees = (Vector2 *)malloc(cellsCount * sizeof(Vector2));
+  placement.spacings = (float *)malloc(cellsCount * sizeof(float));
+  placement.active = (int *)malloc(cellsCount * sizeof(int));
+
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      Vector2 point = {(ToXIso(i, j) - placement.origin.x) / hitbox.width,
+                       (ToYIso(i, j) - placement.origin.y) / hitbox.height};
+      float spacing = GetTreeSpacing(&placement, point);
+      if (spacing > 0.0f && IsTreeSpaced(&placement, point, spacing)) {
+        AddTree(&placement, point, spacing);
+        SpreadTrees(&placement);
+      }
+    }
+  }
+  for (int i = 0; i < placement.treesCount; i++) {
+    Vector2 point = placement.trees[i];
+    AddToWorld(world, TREE,
+               (Vector2){placement.origin.x + point.x * hitbox.width,
+                         placement.origin.y + point.y * hitbox.height});
+  }
+  free(placement.grid);
+  free(placement.trees);
+  free(placement.spacings);
+  free(placement.active);
+}
+
+static void GenerateEntities(World *world) {
+  world->entitiesCapacity = 20;
+  world->entities = (Entity *)malloc(world->entitiesCapacity * sizeof(Entity));
+  world->entitiesHash =
+      (uint64_t *)malloc(world->entitiesCapacity * sizeof(uint64_t));
+
+  // Where the camera starts
+  int mapCenterX = ToXIso(world->mapSize.x / 2, world->mapSize.y / 2);
+  int mapCenterY = ToYIso(world->mapSize.x / 2, world->mapSize.y / 2);
+
+  // CITY_HALL
+  AddToWorld(world, CITY_HALL, (Vector2){mapCenterX, mapCenterY});
+
+  // VILLAGERS
+  AddToWorld(world, VILLAGER, (Vector2){mapCenterX - 400, mapCenterY});
+  AddToWorld(world, VILLAGER, (Vector2){mapCenterX, mapCenterY - 400});
+  AddToWorld(world, VILLAGER, (Vector2){mapCenterX, mapCenterY + 1100});
+
+  perlin_init(world->seed);
+  // Noise is the expensive part: sample it in parallel, rows by rows, then
+  // place trees serially so their order stays the same
+  world->treesDensity =
+      (float *)malloc(world->mapSize.x * world->mapSize.y * sizeof(float));
+  JobGroup group = {0};
+  JobsParallelFor(world->mapSize.y, 8, ComputeTreesDensity, world, &group);
+  JobsWait(&group);
+  PlaceTrees(world, (Vector2){mapCenterX, mapCenterY});
+  free(world->treesDensity);
+  world->treesDensity = NULL;
+}
+
+static void FreeWorld(World *world) {
+  for (int i = 0; world->map && i < world->mapSize.y; i++) {
+    free(world->map[i]);
+  }
+  free(world->map);
+  free(world->entities);
+  free(world->entitiesHash);
+  free(world->treesDensity);
+  *world = (World){0};
+}
+
+// WORLD CACHE
+//
+// Generated worlds are saved in WORLD_CACHE_PATH, one file per seed and map
+// size, and loaded in one read instead of being generated again, as when
+// replaying or playing a fixed --seed. Only those worlds are cached: a random
+// seed is not played again, so its file would only fill the directory. Only
+// what the generator decides is stored, entities get the rest from
+// CreateEntity when loaded.
+//
+// File: "WOPW", u16 WORLD_CACHE_VERSION, u64 generator key, u32 seed, u16
+// map width and height, u8 tile per tile, u32 entities count, then per
+// entity: u8 type, f32 x and y position.
+
+// Changes with the generator version and parameters, the size of the tiles
+// the positions come from and the noise of the seed, which perlin_init must
+// have been called with
+static uint64_t GetWorldGeneratorKey(void) {
+  int version = WORLD_GENERATOR_VERSION;
+  uint64_t key = HashBytes(FNV_OFFSET_BASIS, &version, sizeof(int));
+  key = HashBytes(key, &worldGenerator, sizeof(worldGenerator));
+  key = HashBytes(key, &grassTexture.texture.width, sizeof(int));
+  key = HashBytes(key, &grassTexture.texture.height, sizeof(int));
+  for (int i = 0; i < 4; i++) {
+    float noise = perlin2D_octaves(i * 1.7f, i * 2.3f, 4, 0.5f);
+    key = HashBytes(key, &noise, sizeof(float));
+  }
+  return key;
+}
+
+// Not TextFormat, which is not thread safe
+static void GetWorldCacheFileName(World *world, char *fileName, int size) {
+  snprintf(fileName, size, WORLD_CACHE_PATH "/%d_%dx%d.wopw", world->seed,
+           (int)world->mapSize.x, (int)world->mapSize.y);
+}
+
+static void SaveWorldCache(World *world, uint64_t generatorKey) {
+  ByteWriter writer = {0};
+  WriteBytes(&writer, WORLD_CACHE_MAGIC, 4);
+  WriteU16(&writer, WORLD_CACHE_VERSION);
+  WriteU64(&writer, generatorKey);
+  WriteU32(&writer, (uint32_t)world->seed);
+  WriteU16(&writer, world->mapSize.x);
+  WriteU16(&writer, world->mapSize.y);
+  for (int i = 0; i < world->mapSize.y; i++) {
+    for (int j = 0; j < world->mapSize.x; j++) {
+      WriteU8(&writer, world->map[i][j]);
+    }
+  }
+  WriteU32(&writer, world->entitiesSize);
+  for (int i = 0; i < world->entitiesSize; i++) {
+    WriteU8(&writer, world->entities[i].type);
+    WriteF32(&writer, world->entities[i].position.x);
+    WriteF32(&writer, world->entities[i].position.y);
+  }
+#if defined(_WIN32)
+  _mkdir(WORLD_CACHE_PATH);
+#else
+  mkdir(WORLD_CACHE_PATH, 0755);
+#endif
+  char fileName[256];
+  GetWorldCacheFileName(world, fileName, sizeof(fileName));
+  SaveFileData(fileName, writer.data, writer.size);
+  FreeByteWriter(&writer);
+}
+
+// Returns false, with nothing allocated, when there is no valid cached world
+// for this seed, map size and generator
+static bool LoadWorldCache(World *world, uint64_t generatorKey) {
+  char fileName[256];
+  GetWorldCacheFileName(world, fileName, sizeof(fileName));
+  if (!FileExists(fileName))
+    return false;
+  int dataSize = 0;
+  unsigned char *data = LoadFileData(fileName, &dataSize);
+  ByteReader reader = CreateByteReader(data, dataSize);
+  char magic[4];
+  ReadBytes(&reader, magic, 4);
+  bool isValid = memcmp(magic, WORLD_CACHE_MAGIC, 4) == 0 &&
+                 ReadU16(&reader) == WORLD_CACHE_VERSION &&
+                 ReadU64(&reader) == generatorKey &&
+                 ReadU32(&reader) == (uint32_t)world->seed &&
+                 ReadU16(&reader) == world->mapSize.x &&
+                 ReadU16(&reader) == world->mapSize.y && reader.isValid;
+  if (isValid) {
+    GenerateMap(world);
+    for (int i = 0; i < world->mapSize.y; i++) {
+      for (int j = 0; j < world->mapSize.x; j++) {
+        int tile = ReadU8(&reader);
+        isValid = isValid && tile < TILES_COUNT;
+        world->map[i][j] = tile;
+      }
+    }
+    world->mapHash = HashMap(world->map, world->mapSize);
+    uint32_t entitiesCount = ReadU32(&reader);
+    isValid = isValid && reader.isValid &&
+              entitiesCount <= (uint32_t)(dataSize - reader.position) / 9;
+    world->entitiesCapacity = 20;
+    world->entities =
+        (Entity *)malloc(world->entitiesCapacity * sizeof(Entity));
+    world->entitiesHash =
+        (uint64_t *)malloc(world->entitiesCapacity * sizeof(uint64_t));
+    for (uint32_t i = 0; isValid && i < entitiesCount; i++) {
+      EntityType type = ReadU8(&reader);
+      Vector2 position;
+      position.x = ReadF32(&reader);
+      position.y = ReadF32(&reader);
+      isValid = type < ENTITY_TYPES_COUNT;
+      if (isValid)
+        AddToWorld(world, type, position);
+    }
+    isValid = isValid && reader.isValid && IsByteReaderAtEnd(&reader);
+  }
+  UnloadFileData(data);
+  if (!isValid) {
+    TraceLog(LOG_WARNING, "WORLD: [%s] Stale or invalid cached world",
+             fileName);
+    World settings = {.seed = world->seed,
+                      .mapSize = world->mapSize,
+                      .isCacheable = world->isCacheable};
+    FreeWorld(world);
+    *world = settings;
+  }
+  return isValid;
+}
+
+// Job, only needs the size of the grass texture
+static void GenerateWorld(void *data) {
+  World *world = (World *)data;
+  perlin_init(world->seed);
+  uint64_t generatorKey = GetWorldGeneratorKey();
+  TRACE_BEGIN("LoadWorldCache");
+  bool isCached = world->isCacheable && LoadWorldCache(world, generatorKey);
+  TRACE_END("LoadWorldCache");
+  if (isCached)
+    return;
+  TRACE_BEGIN("GenerateMap");
+  GenerateMap(world);
+  TRACE_END("GenerateMap");
+  TRACE_BEGIN("GenerateEntities");
+  GenerateEntities(world);
+  TRACE_END("GenerateEntities");
+  if (world->isCacheable)
+    SaveWorldCache(world, generatorKey);
+}
+
+static bool IsWorldForSettings(World *world) {
+  return world->seed == worldSeed && world->mapSize.x == mapSize.x &&
+         world->mapSize.y == mapSize.y;
+}
+
+// Frees the ready world if it was generated for other settings
+static void DropStaleWorld(void) {
+  if (readyWorld && !IsWorldForSettings(readyWorld)) {
+    FreeWorld(readyWorld);
+    readyWorld = NULL;
+  }
+}
+
+// The finished world replaces the ready one, unless only the ready one is
+// for the current settings (they were changed back meanwhile)
+static void PromoteGeneratingWorld(void) {
+  World *staleWorld = generatingWorld;
+  if (!readyWorld || IsWorldForSettings(generatingWorld) ||
+      !IsWorldForSettings(readyWorld)) {
+    staleWorld = readyWorld;
+    readyWorld = generatingWorld;
+  }
+  if (staleWorld)
+    FreeWorld(staleWorld);
+  generatingWorld = NULL;
+}
+
+// Called every frame: collects the generated world and, in the menu, starts
+// generating another one into the other buffer when the settings changed.
+// Without workers the world is generated when the game starts instead.
+static void UpdateWorldGeneration(void) {
+  if (generatingWorld && JobsIsDone(&worldGenerationGroup))
+    PromoteGeneratingWorld();
+  if (generatingWorld || current_scene != MENU ||
+      JobsGetThreadsCount() <= 1 || !grassTexture.texture.width)
+    return;
+  if (readyWorld && IsWorldForSettings(readyWorld))
+    return;
+  generatingWorld = readyWorld == &generatedWorlds[0] ? &generatedWorlds[1]
+                                                      : &generatedWorlds[0];
+  *generatingWorld = (World){
+      .seed = worldSeed, .mapSize = mapSize, .isCacheable = isWorldSeedFixed};
+  JobsRun(GenerateWorld, generatingWorld, &worldGenerationGroup);
+}
+
+// Takes the world generated for the current settings over, after waiting for
+// it or generating it now if needed
+static void InstallGeneratedWorld(void) {
+  if (generatingWorld) {
+    JobsWait(&worldGenerationGroup);
+    PromoteGeneratingWorld();
+  }
+  DropStaleWorld();
+  if (!readyWorld) {
+    readyWorld = &generatedWorlds[0];
+    *readyWorld = (World){.seed = worldSeed,
+                          .mapSize = mapSize,
+                          .isCacheable = isWorldSeedFixed};
+    GenerateWorld(readyWorld);
+  }
+  FreeEntities();
+  FreeMap();
+  mapSize = readyWorld->mapSize;
+  map = readyWorld->map;
+  mapHash = readyWorld->mapHash;
+  entities = readyWorld->entities;
+  entitiesSize = readyWorld->entitiesSize;
+  entitiesCapacity = readyWorld->entitiesCapacity;
+  entitiesHash = readyWorld->entitiesHash;
+  entitiesHashSum = readyWorld->entitiesHashSum;
+  entitiesNextPosition =
+      (Vector2 *)malloc(entitiesCapacity * sizeof(Vector2));
+  // The game owns the arrays now
+  *readyWorld = (World){0};
+  readyWorld = NULL;
+  InitTerrainBlocks();
+}
+
+static void FreeWorldGeneration(void) {
+  if (generatingWorld) {
+    JobsWait(&worldGenerationGroup);
+    PromoteGeneratingWorld();
+  }
+  if (readyWorld)
+    FreeWorld(readyWorld);
+  readyWorld = NULL;
+}
+
 void InitResources(void) {
   resources.wood = 50;
   resources.stone = 50;
   resources.gold = 0;
-  resources.food = 0;
+  resources.food = 200;
 }
 
 static void InitGame(void) {
-  InitMap();
-  InitEntities();
+  TRACE_BEGIN("InstallGeneratedWorld");
+  InstallGeneratedWorld();
+  TRACE_END("InstallGeneratedWorld");
+  InitEntityIds();
+  InitEntitiesGrid();
+  InitVision();
+  InitPopulation();
+  InitCombat();
+  gatherersSize = 0;
+  productionQueuesSize = 0;
   InitResources();
+  if (battleSize > 0)
+    SpawnBattle(battleSize);
 }
 
 static void FreeEntities(void) {
@@ -561,6 +3776,10 @@ static void FreeEntities(void) {
     entities = NULL;
     entitiesSize = 0;
   }
+  free(entitiesNextPosition);
+  entitiesNextPosition = NULL;
+  free(entitiesHash);
+  entitiesHash = NULL;
 }
 
 static void FreeSelectedEntities(void) {
@@ -578,40 +3797,21 @@ static void FreeMap(void) {
     }
     free(map);
     map = NULL;
+    FreeTerrainBlocks();
   }
 }
 
 static void FreeGame(void) {
+  FreeSpatialGrid(&entitiesGrid);
+  FreeEntityIds();
+  FreeGathering();
+  FreeProduction();
+  FreeVision();
+  FreeCombat();
   FreeEntities();
   FreeSelectedEntities();
   FreeMap();
-}
-
-static GameTexture TileToTexture(enum Tile tile) {
-  switch (tile) {
-  case GRASS:
-    return grassTexture;
-    break;
-  }
-}
-
-// Needed and avoid pointers to textures from entities to ease resolution of
-// textures depending on the current age of the player
-static GameTexture EntityToTexture(enum EntityType type) { // TODO: support ages
-  switch (type) {
-  case CITY_HALL:
-    return primitiveCityHallTexture;
-    break;
-  case VILLAGER:
-    return primitiveVillagerTexture;
-    break;
-  case SHELTER:
-    return primitiveShelterTexture;
-    break;
-  case TREE:
-    return treeTexture;
-    break;
-  }
+  FreeWorldGeneration();
 }
 
 // ISOMETRIC HELPERS
@@ -681,32 +3881,33 @@ static void CheckMouseZoom(Camera2D *camera) {
   }
 }
 
-static void CheckSelect(Camera2D *camera) {
+static void SendCommand(Command command) {
+  if (!SpscQueuePush(&commandsQueue, &command))
+    TraceLog(LOG_WARNING, "Commands queue is full, command dropped");
+}
+
+static void CheckSelect(Camera2D *camera, RenderSnapshot *snapshot) {
   if (atCursorTexture != NULL)
     return;
   if (!IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
     return;
-  FreeSelectedEntities();
   Vector2 mousePosition = GetMousePosition();
   Vector2 mousePositionInWorld = GetScreenToWorld2D(mousePosition, *camera);
-  for (int i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    if (entity->isControllable == false)
+  int selectedId = -1;
+  for (int i = 0; i < snapshot->entitiesSize; i++) {
+    EntitySnapshot *entity = &snapshot->entities[i];
+    if (!archetypes[entity->type].isControllable ||
+        entity->team != TEAM_PLAYER || !IsEntityRevealed(entity))
       continue;
-    GameTexture entityTexture = EntityToTexture(entity->type);
-    int entityWidth =
-        entityTexture.texture.width / (float)entityTexture.animFramesNumber;
-    int entityHeight = entityTexture.texture.height;
-    Vector2 entitySize = (Vector2){entityWidth, entityHeight};
-    Rectangle entityHitbox = GetEntityHitbox(entity);
-    if (CheckCollisionPointRec(mousePositionInWorld, entityHitbox)) {
-      AddToSelectedEntities(entity);
-      return;
+    if (CheckCollisionPointRec(mousePositionInWorld, entity->hitbox)) {
+      selectedId = entity->id;
+      break;
     }
   }
+  SendCommand((Command){.type = COMMAND_SELECT, .entityId = selectedId});
 }
 
-static void CheckBuilding(Camera2D *camera) {
+static void CheckBuilding(Camera2D *camera, RenderSnapshot *snapshot) {
   if (atCursorTexture == NULL)
     return;
   if (!IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
@@ -722,35 +3923,57 @@ static void CheckBuilding(Camera2D *camera) {
       .y = mouseTexturePosition.y,
       .width = (float)GetGameTextureWidth(atCursorTexture),
       .height = atCursorTexture->texture.height};
-  for (int i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    GameTexture entityTexture = EntityToTexture(entity->type);
-    Rectangle entityHitbox = GetEntityHitbox(entity);
-    if (CheckCollisionRecs(mouseTextureRectangle, entityHitbox)) {
+  for (int i = 0; i < snapshot->entitiesSize; i++) {
+    if (CheckCollisionRecs(mouseTextureRectangle,
+                           snapshot->entities[i].hitbox)) {
       return;
     }
   }
-  if (TryBuild(atCursorTexture->entityType, mouseTexturePosition)) {
+  // The simulation checks again when applying it, resources may have changed
+  if (CanAffordBuild(atCursorTexture->entityType, &snapshot->resources)) {
+    SendCommand((Command){.type = COMMAND_BUILD,
+                          .entityType = atCursorTexture->entityType,
+                          .position = mouseTexturePosition});
     atCursorTexture = NULL;
   }
 }
 
+// -1 for what is not placed by the player
+static int GetBuildWoodCost(EntityType entityType) {
+  switch (entityType) {
+  case CITY_HALL:
+    return CITY_HALL_WOOD_COST;
+  case SHELTER:
+    return SHELTER_WOOD_COST;
+  default:
+    return -1;
+  }
+}
+
+static bool CanAffordBuild(EntityType entityType, struct Resources *available) {
+  int woodCost = GetBuildWoodCost(entityType);
+  return woodCost >= 0 && available->wood >= woodCost;
+}
+
 static bool TryBuild(EntityType entityType, Vector2 position) {
   switch (entityType) {
   case VILLAGER:
-    // TODO
-    break;
+  case SOLDIER:
+  case ARCHER: {
+    // At the building nearest to position
+    int building = FindNearestSpatialItem(&entitiesGrid, position.x,
+                                          position.y, GetProducerTypesMask());
+    return building >= 0 && TryTrain(building, entityType);
+  }
   case CITY_HALL:
-    // TODO
-    break;
   case SHELTER:
-    if (resources.wood >= 50) {
-      resources.wood -= 50;
-      AddToEntities(entityType, position);
+    if (CanAffordBuild(entityType, &resources)) {
+      resources.wood -= GetBuildWoodCost(entityType);
+      AddToEntities(entityType, position, TEAM_PLAYER);
       return true;
     }
     break;
-  case TREE:
+  default:
     break;
   }
   return false;
@@ -760,14 +3983,9 @@ static void CheckMovement(Camera2D *camera) {
   Vector2 mousePosition = GetMousePosition();
   if (!IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
     return;
-  for (int i = 0; i < entitiesSize; i++) {
-    Entity *entity = &entities[i];
-    if (!entity->isControllable || !entity->isSelected) {
-      continue;
-    }
-    Vector2 mousePositionInWorld = GetScreenToWorld2D(mousePosition, *camera);
-    entity->targetPosition = mousePositionInWorld;
-  }
+  Vector2 mousePositionInWorld = GetScreenToWorld2D(mousePosition, *camera);
+  SendCommand(
+      (Command){.type = COMMAND_MOVE, .position = mousePositionInWorld});
 }
 
 static void CheckInputs() {
@@ -777,7 +3995,691 @@ static void CheckInputs() {
   if (IsKeyPressed(KEY_S)) {
     atCursorTexture = &primitiveShelterTexture;
   }
+  if (IsKeyPressed(KEY_C)) {
+    atCursorTexture = &primitiveCityHallTexture;
+  }
+  // Trained at the city hall nearest the view center
+  EntityType trainedType = IsKeyPressed(KEY_V)   ? VILLAGER
+                           : IsKeyPressed(KEY_M) ? SOLDIER
+                           : IsKeyPressed(KEY_R) ? ARCHER
+                                                 : ENTITY_TYPES_COUNT;
+  if (trainedType != ENTITY_TYPES_COUNT) {
+    SendCommand((Command){.type = COMMAND_BUILD,
+                          .entityType = trainedType,
+                          .position = camera.target});
+  }
   if (IsKeyPressed(KEY_ENTER)) {
     toggleHitboxes = !toggleHitboxes;
   }
+  if (IsKeyPressed(KEY_F3)) {
+    toggleDebugOverlay = !toggleDebugOverlay;
+  }
+  if (IsKeyPressed(KEY_F4)) {
+    WriteTrace();
+  }
+}
+
+// SIMULATION
+//
+// Entities and resources belong to the simulation. It runs on its own thread
+// at a fixed tick rate, receives player commands through commandsQueue and
+// publishes a RenderSnapshot every tick, so a slow tick does not slow the
+// rendering down and the other way around.
+
+static void ApplyCommand(Command *command) {
+  switch (command->type) {
+  case COMMAND_SELECT: {
+    selectionVersion++;
+    FreeSelectedEntities();
+    // -1 when the entity was removed since the snapshot it was picked in
+    int index = GetEntityIndex(command->entityId);
+    if (index >= 0 && entities[index].team == TEAM_PLAYER)
+      AddToSelectedEntities(&entities[index]);
+    break;
+  }
+  case COMMAND_MOVE: {
+    // Onto a resource, the villagers gather it. Onto an enemy, the units
+    // that can attack it.
+    int resourceIndex =
+        FindEntityAt(command->position, GetGatherableTypesMask());
+    int enemyIndex =
+        FindEntityAt(command->position, GetEnemiesMask(TEAM_PLAYER));
+    for (int i = 0; i < entitiesSize; i++) {
+      Entity *entity = &entities[i];
+      if (!archetypes[entity->type].isControllable || !entity->isSelected) {
+        continue;
+      }
+      if (resourceIndex >= 0 && archetypes[entity->type].canGather) {
+        StartGathering(i, resourceIndex);
+        continue;
+      }
+      if (enemyIndex >= 0 && archetypes[entity->type].attackDamage > 0) {
+        Attack(i, enemyIndex);
+        continue;
+      }
+      StopGathering(i);
+      StopFighting(i);
+      entity->targetPosition = command->position;
+    }
+    break;
+  }
+  case COMMAND_BUILD:
+    TryBuild(command->entityType, command->position);
+    break;
+  }
+}
+
+static void PublishRenderSnapshot(void) {
+  RenderSnapshot *snapshot =
+      &renderSnapshots[TripleBufferGetBack(&renderSnapshotsBuffer)];
+  if (snapshot->entitiesCapacity < entitiesSize) {
+    snapshot->entitiesCapacity = entitiesCapacity;
+    snapshot->entities =
+        realloc(snapshot->entities,
+                snapshot->entitiesCapacity * sizeof(EntitySnapshot));
+  }
+  for (int i = 0; i < entitiesSize; i++) {
+    Entity *entity = &entities[i];
+    snapshot->entities[i] =
+        (EntitySnapshot){.id = entity->id,
+                         .position = entity->position,
+                         .hitbox = GetEntityHitbox(entity),
+                         .type = entity->type,
+                         .team = entity->team,
+                         .animPhase = entity->animPhase,
+                         .isSelected = entity->isSelected,
+                         .fog = GetEntityFog(entity)};
+  }
+  snapshot->entitiesSize = entitiesSize;
+  snapshot->resources = resources;
+  snapshot->population = GetPopulation();
+  snapshot->maxPopulation = GetMaxPopulation();
+  snapshot->queuedPopulation = queuedPopulation;
+  snapshot->tick = simulationTick;
+  snapshot->stateHash = GetSimulationStateHash();
+  if (snapshot->visionVersion != visionVersion) {
+    if (snapshot->tilesWordsCount != tilesWordsCount) {
+      snapshot->tilesWordsCount = tilesWordsCount;
+      snapshot->visibleTiles = realloc(snapshot->visibleTiles,
+                                       tilesWordsCount * sizeof(uint64_t));
+      snapshot->exploredTiles = realloc(snapshot->exploredTiles,
+                                        tilesWordsCount * sizeof(uint64_t));
+    }
+    memcpy(snapshot->visibleTiles, visibleTiles,
+           tilesWordsCount * sizeof(uint64_t));
+    memcpy(snapshot->exploredTiles, exploredTiles,
+           tilesWordsCount * sizeof(uint64_t));
+    snapshot->visionVersion = visionVersion;
+  }
+  if (snapshot->changedEntitiesCapacity < pendingChangesSize) {
+    snapshot->changedEntitiesCapacity = pendingChangesCapacity;
+    snapshot->changedEntities =
+        realloc(snapshot->changedEntities,
+                snapshot->changedEntitiesCapacity * sizeof(int));
+  }
+  if (pendingChangesSize > 0) {
+    memcpy(snapshot->changedEntities, pendingChanges,
+           pendingChangesSize * sizeof(int));
+  }
+  snapshot->changedEntitiesSize = pendingChangesSize;
+  snapshot->changesEnd = pendingChangesStart + pendingChangesSize;
+  snapshot->hasLostChanges = hasLostChanges;
+  snapshot->selectionVersion = selectionVersion;
+  if (TripleBufferPublish(&renderSnapshotsBuffer)) {
+    // The buffer taken back was read: its changes do not need to be sent
+    // again
+    RenderSnapshot *read =
+        &renderSnapshots[TripleBufferGetBack(&renderSnapshotsBuffer)];
+    int readCount = read->changesEnd - pendingChangesStart;
+    if (readCount > 0) {
+      pendingChangesSize -= readCount;
+      memmove(pendingChanges, pendingChanges + readCount,
+              pendingChangesSize * sizeof(int));
+      pendingChangesStart = read->changesEnd;
+    }
+    if (read->hasLostChanges)
+      hasLostChanges = false;
+  }
+}
+
+// Remembers that an entity moved or was added, for the renderer
+static void RecordEntityChange(int index) {
+  if (isHeadless)
+    return;
+  if (pendingChangesSize == MAX_PENDING_CHANGES) {
+    // The renderer does not keep up, it will rebuild everything instead
+    pendingChangesStart += pendingChangesSize;
+    pendingChangesSize = 0;
+    hasLostChanges = true;
+  }
+  if (pendingChangesSize == pendingChangesCapacity) {
+    pendingChangesCapacity = pendingChangesCapacity ? pendingChangesCapacity * 2
+                                                    : 256;
+    pendingChanges =
+        realloc(pendingChanges, pendingChangesCapacity * sizeof(int));
+  }
+  pendingChanges[pendingChangesSize++] = index;
+}
+
+// STATE HASH
+//
+// Fingerprint of everything the simulation depends on, equal between a
+// session and its replays at the same tick. The entities hashes are summed so
+// only the entities whose position, hp or type changed need to be rehashed:
+// call UpdateEntityHash after changing one of them.
+
+static uint64_t HashEntity(Entity *entity, int index) {
+  uint64_t hash = HashBytes(FNV_OFFSET_BASIS, &index, sizeof(int));
+  hash = HashBytes(hash, &entity->position, sizeof(Vector2));
+  hash = HashBytes(hash, &entity->hp, sizeof(int));
+  hash = HashBytes(hash, &entity->team, sizeof(Team));
+  return HashBytes(hash, &entity->type, sizeof(EntityType));
+}
+
+static void UpdateEntityHash(int index) {
+  uint64_t hash = HashEntity(&entities[index], index);
+  entitiesHashSum += hash - entitiesHash[index];
+  entitiesHash[index] = hash;
+}
+
+static uint64_t HashMap(enum Tile **tiles, Vector2 size) {
+  uint64_t hash = HashBytes(FNV_OFFSET_BASIS, &size, sizeof(Vector2));
+  for (int i = 0; i < size.y; i++) {
+    hash = HashBytes(hash, tiles[i], size.x * sizeof(enum Tile));
+  }
+  return hash;
+}
+
+static uint64_t CombineStateHash(uint64_t tilesHash, uint64_t entitiesSum) {
+  uint64_t hash = HashBytes(tilesHash, &entitiesSize, sizeof(int));
+  hash = HashBytes(hash, &entitiesSum, sizeof(uint64_t));
+  return HashBytes(hash, &resources, sizeof(struct Resources));
+}
+
+static uint64_t GetSimulationStateHash(void) {
+  return CombineStateHash(mapHash, entitiesHashSum);
+}
+
+// Rehashes the whole state, to check the incremental hash
+static uint64_t ComputeSimulationStateHash(void) {
+  uint64_t sum = 0;
+  for (int i = 0; i < entitiesSize; i++) {
+    sum += HashEntity(&entities[i], i);
+  }
+  return CombineStateHash(HashMap(map, mapSize), sum);
+}
+
+// Works without a window, unlike GetTime()
+static double GetMonotonicTime(void) {
+#if defined(_WIN32)
+  // Declared by trace.h
+  unsigned long long int counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double)counter / frequency;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Adds the time since *start to system and restarts *start from now
+static void ProfileSystem(SimulationSystem system, double *start) {
+  double now = GetMonotonicTime();
+  simulationSystemsTime[system] += now - *start;
+  *start = now;
+}
+
+static void SimulationTick(void) {
+  TRACE_BEGIN("SimulationTick");
+  double start = GetMonotonicTime();
+  if (!isReplaying && simulationTick % STATE_HASH_LOG_INTERVAL == 0)
+    LogStateHash();
+  Command command;
+  while (SpscQueuePop(&commandsQueue, &command)) {
+    if (isReplaying)
+      continue; // Player input is ignored while replaying
+    LogCommand(&command);
+    ApplyCommand(&command);
+  }
+  if (isReplaying) {
+    ReplayCommands();
+    if (isReplayDone) {
+      TRACE_END("SimulationTick");
+      return; // Keep the final state of the replayed session
+    }
+  }
+  ProfileSystem(SYSTEM_COMMANDS, &start);
+  TRACE_BEGIN("ProcessGathering");
+  ProcessGathering();
+  TRACE_END("ProcessGathering");
+  ProfileSystem(SYSTEM_GATHERING, &start);
+  TRACE_BEGIN("ProcessProduction");
+  ProcessProduction();
+  TRACE_END("ProcessProduction");
+  ProfileSystem(SYSTEM_PRODUCTION, &start);
+  TRACE_BEGIN("ProcessCombat");
+  ProcessCombat();
+  TRACE_END("ProcessCombat");
+  ProfileSystem(SYSTEM_COMBAT, &start);
+  TRACE_BEGIN("ProcessMovements");
+  ProcessMovements();
+  TRACE_END("ProcessMovements");
+  ProfileSystem(SYSTEM_MOVEMENTS, &start);
+  TRACE_BEGIN("ProcessVision");
+  ProcessVision();
+  TRACE_END("ProcessVision");
+  ProfileSystem(SYSTEM_VISION, &start);
+  simulationTick++;
+  if (!isHeadless) {
+    PublishRenderSnapshot();
+    ProfileSystem(SYSTEM_SNAPSHOT, &start);
+  }
+  TRACE_END("SimulationTick");
+}
+
+#if !defined(JOBS_NO_THREADS)
+
+static void *SimulationLoop(void *argument) {
+  TraceSetThreadName("simulation");
+  const double tickDuration = 1.0 / SIMULATION_TICK_RATE;
+  double nextTick = GetMonotonicTime();
+  while (atomic_load(&isSimulationRunning)) {
+    SimulationTick();
+    nextTick += tickDuration;
+    double delay = nextTick - GetMonotonicTime();
+    if (delay > 0) {
+      struct timespec sleepTime = {.tv_sec = 0,
+                                   .tv_nsec = (long)(delay * 1e9)};
+      nanosleep(&sleepTime, NULL);
+    } else if (delay < -0.25) {
+      // Too late to catch up, run from now on instead of bursting ticks
+      nextTick = GetMonotonicTime();
+    }
+  }
+  return NULL;
+}
+#endif
+
+static void StartSimulation(void) {
+  TripleBufferInit(&renderSnapshotsBuffer);
+  SpscQueueInit(&commandsQueue, COMMANDS_QUEUE_SIZE, sizeof(Command));
+  simulationTick = 0;
+  memset(simulationSystemsTime, 0, sizeof(simulationSystemsTime));
+  // The renderer builds the minimap from the first snapshot
+  pendingChangesSize = 0;
+  pendingChangesStart = 0;
+  hasLostChanges = false;
+  if (!isReplaying)
+    BeginCommandLog();
+  // The first frame needs something to draw
+  PublishRenderSnapshot();
+#if !defined(JOBS_NO_THREADS)
+  if (useSimulationThread) {
+    atomic_store(&isSimulationRunning, true);
+    pthread_create(&simulationThread, NULL, SimulationLoop, NULL);
+  }
+#endif
+}
+
+static void StopSimulation(void) {
+#if !defined(JOBS_NO_THREADS)
+  if (atomic_load(&isSimulationRunning)) {
+    atomic_store(&isSimulationRunning, false);
+    pthread_join(simulationThread, NULL);
+  }
+#endif
+  if (commandLog.data)
+    EndCommandLog(LAST_SESSION_LOG_PATH);
+  if (replayData) {
+    UnloadFileData(replayData);
+    replayData = NULL;
+  }
+  SpscQueueFree(&commandsQueue);
+  for (int i = 0; i < 3; i++) {
+    free(renderSnapshots[i].entities);
+    free(renderSnapshots[i].changedEntities);
+    free(renderSnapshots[i].visibleTiles);
+    free(renderSnapshots[i].exploredTiles);
+    renderSnapshots[i] = (RenderSnapshot){0};
+  }
+  free(pendingChanges);
+  pendingChanges = NULL;
+  pendingChangesCapacity = 0;
+  pendingChangesSize = 0;
+}
+
+// DYNAMIC RESOLUTION
+//
+// The world is rendered to renderTarget at renderScale of the framebuffer
+// size, between RENDER_SCALE_MIN and 1, to hold FRAME_TIME_BUDGET on slow
+// GPUs. raylib has no GPU timers: when a frame is over budget while its CPU
+// part is not, the rest of the frame is spent waiting for the GPU and a lower
+// resolution helps. A CPU bound frame keeps its resolution.
+
+// Reloads renderTarget when the scale or the window size changed
+static void UpdateRenderTarget(void) {
+  int width = GetRenderWidth() * renderScale;
+  int height = GetRenderHeight() * renderScale;
+  if (renderTarget.id && renderTarget.texture.width == width &&
+      renderTarget.texture.height == height)
+    return;
+  if (renderTarget.id)
+    UnloadRenderTexture(renderTarget);
+  renderTarget = LoadRenderTexture(width, height);
+  SetTextureFilter(renderTarget.texture, TEXTURE_FILTER_BILINEAR);
+}
+
+static void UpdateDynamicResolution(double cpuTime, double frameTime) {
+  averageFrameTime += (frameTime - averageFrameTime) * 0.1;
+  averageCpuTime += (cpuTime - averageCpuTime) * 0.1;
+  if (framesSinceRaise >= 0 && ++framesSinceRaise > 5 * 60)
+    framesSinceRaise = -1;
+  if (renderScaleCooldown > 0) {
+    renderScaleCooldown--;
+    return;
+  }
+  bool isOverBudget = averageFrameTime > FRAME_TIME_BUDGET * 1.1;
+  bool isGpuBound = averageCpuTime < FRAME_TIME_BUDGET * 0.9;
+  if (isOverBudget && isGpuBound && renderScale > RENDER_SCALE_MIN) {
+    // The last raise did not hold, wait longer before the next one
+    if (framesSinceRaise >= 0 && framesBeforeRaise < 16 * 60)
+      framesBeforeRaise *= 2;
+    framesSinceRaise = -1;
+    renderScale -= RENDER_SCALE_STEP;
+    if (renderScale < RENDER_SCALE_MIN)
+      renderScale = RENDER_SCALE_MIN;
+    framesWithinBudget = 0;
+    renderScaleCooldown = 30; // Let the averages settle
+    averageFrameTime = FRAME_TIME_BUDGET;
+    return;
+  }
+  framesWithinBudget = isOverBudget ? 0 : framesWithinBudget + 1;
+  if (framesWithinBudget >= framesBeforeRaise && renderScale < 1.0f) {
+    renderScale += RENDER_SCALE_STEP;
+    if (renderScale > 1.0f)
+      renderScale = 1.0f;
+    framesWithinBudget = 0;
+    framesSinceRaise = 0;
+    renderScaleCooldown = 30;
+  }
+}
+
+// IDLE FRAMES
+//
+// The world is only rendered again when something it depends on changed:
+// the camera, the render target size, the entities (known from the snapshot
+// changes sequence), the selection, the texture following the cursor, or an
+// animation frame in view. Otherwise the previous renderTarget is presented
+// again. With --idle-fps, the frame rate also drops once neither the world,
+// the HUD nor the mouse changed for IDLE_FRAMES_BEFORE_LOW_REFRESH frames.
+
+static WorldView GetWorldView(RenderSnapshot *snapshot) {
+  WorldView view;
+  memset(&view, 0, sizeof(view)); // Padding included, views are memcmp'd
+  view.camera = camera;
+  view.targetWidth = renderTarget.texture.width;
+  view.targetHeight = renderTarget.texture.height;
+  view.changesEnd = snapshot->changesEnd;
+  view.selectionVersion = snapshot->selectionVersion;
+  view.atCursorTexture = atCursorTexture;
+  if (atCursorTexture)
+    view.cursorPosition = GetMousePosition();
+  view.showHitboxes = toggleHitboxes;
+  return view;
+}
+
+// Returns false when renderTarget already holds the world as it would be
+// drawn now, else records the view about to be rendered
+static bool ShouldRenderWorld(RenderSnapshot *snapshot) {
+  WorldView view = GetWorldView(snapshot);
+  if (!isWorldViewStale && GetTime() < worldAnimationsEnd &&
+      memcmp(&view, &renderedWorldView, sizeof(view)) == 0)
+    return false;
+  renderedWorldView = view;
+  isWorldViewStale = false;
+  return true;
+}
+
+static HudView GetHudView(RenderSnapshot *snapshot) {
+  HudView view;
+  memset(&view, 0, sizeof(view));
+  view.resources = snapshot->resources;
+  view.population = snapshot->population;
+  view.maxPopulation = snapshot->maxPopulation;
+  view.queuedPopulation = snapshot->queuedPopulation;
+  view.screenWidth = GetScreenWidth();
+  view.screenHeight = GetScreenHeight();
+  view.showHelp = toggleHelp;
+  return view;
+}
+
+// Call before EndDrawing so the frame rate is restored on the first change
+static void UpdateIdleRefresh(RenderSnapshot *snapshot, bool isWorldRendered) {
+  HudView hudView = GetHudView(snapshot);
+  Vector2 mouseDelta = GetMouseDelta();
+  // The debug overlay shows live values
+  bool isActive = isWorldRendered || toggleDebugOverlay ||
+                  memcmp(&hudView, &presentedHudView, sizeof(hudView)) != 0 ||
+                  mouseDelta.x != 0.0f || mouseDelta.y != 0.0f ||
+                  GetMouseWheelMove() != 0.0f ||
+                  IsMouseButtonDown(MOUSE_BUTTON_LEFT) ||
+                  IsMouseButtonDown(MOUSE_BUTTON_RIGHT);
+  presentedHudView = hudView;
+  idleFrames = isActive ? 0 : idleFrames + 1;
+  bool shouldIdle = idleFps > 0 && idleFrames >= IDLE_FRAMES_BEFORE_LOW_REFRESH;
+  if (shouldIdle != isIdleRefresh) {
+    SetTargetFPS(shouldIdle ? idleFps : TARGET_FPS);
+    isIdleRefresh = shouldIdle;
+  }
+}
+
+// COMMAND LOG
+//
+// Header: "WOPL", u16 version, u32 world seed, u16 map width and height, u16
+// battle size.
+// Records: varint ticks since the previous record, u8 command type, payload.
+// Every STATE_HASH_LOG_INTERVAL ticks a COMMAND_LOG_HASH record holds the
+// state hash before the commands of that tick, so replays find the first tick
+// they diverge at. The last record (COMMAND_LOG_END) holds the final hash.
+
+static void BeginCommandLog(void) {
+  FreeByteWriter(&commandLog);
+  WriteBytes(&commandLog, COMMAND_LOG_MAGIC, 4);
+  WriteU16(&commandLog, COMMAND_LOG_VERSION);
+  WriteU32(&commandLog, (uint32_t)worldSeed);
+  WriteU16(&commandLog, mapSize.x);
+  WriteU16(&commandLog, mapSize.y);
+  WriteU16(&commandLog, battleSize);
+  commandLogLastTick = 0;
+}
+
+static void WriteCommandLogTick(void) {
+  WriteVarint(&commandLog, simulationTick - commandLogLastTick);
+  commandLogLastTick = simulationTick;
+}
+
+static void LogCommand(Command *command) {
+  WriteCommandLogTick();
+  WriteU8(&commandLog, command->type);
+  switch (command->type) {
+  case COMMAND_SELECT:
+    WriteVarint(&commandLog, command->entityId + 1);
+    break;
+  case COMMAND_MOVE:
+    WriteF32(&commandLog, command->position.x);
+    WriteF32(&commandLog, command->position.y);
+    break;
+  case COMMAND_BUILD:
+    WriteU8(&commandLog, command->entityType);
+    WriteF32(&commandLog, command->position.x);
+    WriteF32(&commandLog, command->position.y);
+    break;
+  }
+}
+
+static void LogStateHash(void) {
+  WriteCommandLogTick();
+  WriteU8(&commandLog, COMMAND_LOG_HASH);
+  WriteU64(&commandLog, GetSimulationStateHash());
+}
+
+static void EndCommandLog(const char *fileName) {
+  WriteCommandLogTick();
+  WriteU8(&commandLog, COMMAND_LOG_END);
+  WriteU64(&commandLog, GetSimulationStateHash());
+  SaveFileData(fileName, commandLog.data, commandLog.size);
+  FreeByteWriter(&commandLog);
+}
+
+// Sets the world seed and map size of the log, the simulation then replays it
+static bool LoadCommandLog(const char *fileName) {
+  int dataSize = 0;
+  replayData = LoadFileData(fileName, &dataSize);
+  replayReader = CreateByteReader(replayData, dataSize);
+  char magic[4];
+  ReadBytes(&replayReader, magic, 4);
+  uint16_t version = ReadU16(&replayReader);
+  worldSeed = (int)ReadU32(&replayReader);
+  isWorldSeedFixed = true;
+  int mapWidth = ReadU16(&replayReader);
+  int mapHeight = ReadU16(&replayReader);
+  int logBattleSize = ReadU16(&replayReader);
+  replayNextTick = ReadVarint(&replayReader);
+  if (!replayReader.isValid || memcmp(magic, COMMAND_LOG_MAGIC, 4) != 0 ||
+      version != COMMAND_LOG_VERSION) {
+    TraceLog(LOG_ERROR, "REPLAY: [%s] Invalid command log", fileName);
+    UnloadFileData(replayData);
+    replayData = NULL;
+    return false;
+  }
+  mapSize = (Vector2){mapWidth, mapHeight};
+  battleSize = logBattleSize;
+  isReplaying = true;
+  isReplayDone = false;
+  hasReplayDiverged = false;
+  return true;
+}
+
+// Applies the logged commands of the current tick
+static void ReplayCommands(void) {
+  while (!isReplayDone && replayNextTick == simulationTick) {
+    Command command = {.type = ReadU8(&replayReader)};
+    if (command.type == COMMAND_LOG_HASH) {
+      uint64_t recordedHash = ReadU64(&replayReader);
+      uint64_t hash = GetSimulationStateHash();
+      if (hash != recordedHash && !hasReplayDiverged) {
+        TraceLog(LOG_ERROR,
+                 "REPLAY: Diverged at tick %u, state hash %016llx, recorded "
+                 "%016llx",
+                 simulationTick, (unsigned long long)hash,
+                 (unsigned long long)recordedHash);
+        hasReplayDiverged = true;
+      }
+      replayNextTick += ReadVarint(&replayReader);
+      continue;
+    }
+    if (command.type == COMMAND_LOG_END) {
+      uint64_t recordedHash = ReadU64(&replayReader);
+      uint64_t hash = GetSimulationStateHash();
+      hasReplayDiverged = hasReplayDiverged || hash != recordedHash;
+      TraceLog(hash == recordedHash ? LOG_INFO : LOG_ERROR,
+               "REPLAY: Ended at tick %u, state hash %016llx, recorded "
+               "%016llx (%s)",
+               simulationTick, (unsigned long long)hash,
+               (unsigned long long)recordedHash,
+               hash == recordedHash ? "match" : "MISMATCH");
+      isReplayDone = true;
+      break;
+    }
+    switch (command.type) {
+    case COMMAND_SELECT:
+      command.entityId = (int)ReadVarint(&replayReader) - 1;
+      break;
+    case COMMAND_MOVE:
+      command.position.x = ReadF32(&replayReader);
+      command.position.y = ReadF32(&replayReader);
+      break;
+    case COMMAND_BUILD:
+      command.entityType = ReadU8(&replayReader);
+      command.position.x = ReadF32(&replayReader);
+      command.position.y = ReadF32(&replayReader);
+      break;
+    default:
+      replayReader.isValid = false;
+      break;
+    }
+    if (!replayReader.isValid) {
+      TraceLog(LOG_ERROR, "REPLAY: Truncated command log at tick %u",
+               simulationTick);
+      isReplayDone = true;
+      break;
+    }
+    ApplyCommand(&command);
+    replayNextTick += ReadVarint(&replayReader);
+  }
+}
+
+// FAST REPLAY
+//
+// Runs the loaded replay uncapped on the main thread, to profile long
+// sessions in seconds or to train PGO builds. Draws one frame every
+// renderInterval ticks, nothing at all when headless. Prints the state hash
+// every hashInterval ticks when positive.
+
+static void RunFastReplay(int renderInterval, int hashInterval) {
+  useSimulationThread = false;
+  ticksPerFrame = renderInterval > 0 ? renderInterval : 1;
+  double start = GetMonotonicTime();
+  double renderTime = 0.0;
+  StartGame();
+  double initTime = GetMonotonicTime() - start;
+  start = GetMonotonicTime();
+  if (isHeadless) {
+    while (!isReplayDone) {
+      SimulationTick();
+      if (hashInterval > 0 && simulationTick % hashInterval == 0)
+        printf("tick %u state hash %016llx\n", simulationTick,
+               (unsigned long long)GetSimulationStateHash());
+    }
+  } else {
+    SetTargetFPS(0);
+    while (!isReplayDone && !WindowShouldClose()) {
+      double frameStart = GetMonotonicTime();
+      double simulationTime = 0.0;
+      for (int i = 0; i < SYSTEMS_COUNT; i++) {
+        simulationTime += simulationSystemsTime[i];
+      }
+      UpdateDrawFrame();
+      for (int i = 0; i < SYSTEMS_COUNT; i++) {
+        simulationTime -= simulationSystemsTime[i];
+      }
+      renderTime += GetMonotonicTime() - frameStart + simulationTime;
+    }
+  }
+  double elapsed = GetMonotonicTime() - start;
+
+  printf("Replayed %u ticks (%.1f game minutes) in %.3f s: %.0f ticks/s, "
+         "x%.1f real time\n",
+         simulationTick, simulationTick / (60.0 * SIMULATION_TICK_RATE),
+         elapsed, simulationTick / elapsed,
+         simulationTick / (elapsed * SIMULATION_TICK_RATE));
+  printf("  %-12s %10.3f ms\n", "world init", initTime * 1000.0);
+  for (int i = 0; i < SYSTEMS_COUNT; i++) {
+    printf("  %-12s %10.3f ms total %8.2f us/tick\n", simulationSystemsName[i],
+           simulationSystemsTime[i] * 1000.0,
+           simulationTick ? simulationSystemsTime[i] * 1e6 / simulationTick
+                          : 0.0);
+  }
+  if (!isHeadless)
+    printf("  %-12s %10.3f ms total\n", "rendering", renderTime * 1000.0);
+  uint64_t stateHash = GetSimulationStateHash();
+  uint64_t fullStateHash = ComputeSimulationStateHash();
+  printf("  state hash %016llx", (unsigned long long)stateHash);
+  if (stateHash == fullStateHash)
+    printf(" (full rehash agrees)\n");
+  else
+    printf(" (full rehash DIFFERS: %016llx)\n",
+           (unsigned long long)fullStateHash);
 }